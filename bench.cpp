@@ -0,0 +1,428 @@
+/* Copyright (c) 2013 Dropbox, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Microbenchmarks for miniutf.
+ *
+ * Each function is timed over a set of generated corpora, each made of short records (roughly
+ * filename-sized) in one script. Results are printed as one JSON object per line:
+ *
+ *   {"function": "nfc", "corpus": "greek", "calls": ..., "ns_per_call": ...,
+ *    "bytes_per_sec": ..., "codepoints_per_sec": ..., "allocs_per_call": ...,
+ *    "layout": "compact", "data_bytes": ..., "decoder": "branchy"}
+ *
+ * Bytes and codepoints refer to the UTF-8 input. Allocations are counted by replacing the
+ * global operator new. The layout is that of the Unicode data tables, and is "fast" when
+ * built with -DMINIUTF_FAST_TRIES; data_bytes is their total size. The trie_lookup benchmark
+ * times the table lookups alone, without any of the string handling around them. The decoder is
+ * "dfa" when built with -DMINIUTF_DFA_DECODER.
+ *
+ * Usage: bench [function-or-corpus-substring ...]
+ */
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iterator>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "miniutf.hpp"
+#include "miniutf_collation.hpp"
+#include "miniutf_index.hpp"
+
+// Our own copy of the tables, so the lookups can be timed directly.
+namespace data {
+#include "miniutfdata.h"
+}
+
+using std::string;
+using std::printf;
+
+/* * * * * * * * * *
+ * Allocation counting
+ * * * * * * * * * */
+
+// Atomic, since nfc_batch allocates from several threads at once.
+static std::atomic<unsigned long long> allocation_count(0);
+
+void * operator new(size_t size) {
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+    if (void * p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void * p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void * p, size_t) noexcept {
+    std::free(p);
+}
+
+/*
+ * A per-request arena, for the allocator-aware variants: allocation bumps a pointer through a
+ * fixed buffer, deallocation does nothing, and reset() frees everything at once. It falls back
+ * to operator new (and so is counted) if the buffer runs out.
+ */
+struct arena {
+    alignas(16) char buffer[1 << 16];
+    size_t used = 0;
+
+    void * allocate(size_t size) {
+        size = (size + 15) & ~size_t(15);
+        if (size > sizeof(buffer) - used)
+            return ::operator new(size);
+        used += size;
+        return buffer + used - size;
+    }
+    void reset() { used = 0; }
+};
+
+static arena request_arena;
+
+template <typename T>
+struct arena_allocator {
+    typedef T value_type;
+
+    arena_allocator() {}
+    template <typename U>
+    arena_allocator(const arena_allocator<U> &) {}
+
+    T * allocate(size_t n) { return static_cast<T *>(request_arena.allocate(n * sizeof(T))); }
+    void deallocate(T * p, size_t) {
+        char * bytes = reinterpret_cast<char *>(p);
+        if (bytes < request_arena.buffer || bytes >= std::end(request_arena.buffer))
+            ::operator delete(p);
+    }
+};
+
+template <typename T, typename U>
+bool operator==(const arena_allocator<T> &, const arena_allocator<U> &) { return true; }
+template <typename T, typename U>
+bool operator!=(const arena_allocator<T> &, const arena_allocator<U> &) { return false; }
+
+typedef miniutf::basic_utf8_string<arena_allocator<char>> arena_string;
+typedef miniutf::basic_utf16_string<arena_allocator<char16_t>> arena_u16string;
+
+/* * * * * * * * * *
+ * Corpora
+ * * * * * * * * * */
+
+struct corpus {
+    string name;
+    std::vector<string> records;
+    std::vector<std::u16string> records16;
+    std::vector<std::u32string> records32;
+    std::vector<string> records16le;
+    std::vector<string> records_latin1; // lossy outside the latin1 corpus
+    size_t bytes;
+    size_t codepoints;
+};
+
+/*
+ * Generate records of 8 to 48 codepoints each, drawn by pick(), with a space every few
+ * codepoints, until there are about total_bytes of UTF-8.
+ */
+static corpus make_corpus(const string & name,
+                          const std::function<void (std::mt19937 &, std::u32string &)> & pick,
+                          size_t total_bytes = 1 << 16) {
+    std::mt19937 gen(1); // fixed seed, so runs are comparable
+    std::uniform_int_distribution<> length(8, 48), word(3, 10);
+
+    corpus c { name, {}, {}, {}, {}, {}, 0, 0 };
+    while (c.bytes < total_bytes) {
+        std::u32string s;
+        int n = length(gen), next_space = word(gen);
+        while (static_cast<int>(s.size()) < n) {
+            if (static_cast<int>(s.size()) == next_space) {
+                s += ' ';
+                next_space += word(gen);
+            }
+            pick(gen, s);
+        }
+        c.records.push_back(miniutf::to_utf8(s));
+        c.records16.push_back(miniutf::to_utf16(c.records.back()));
+        c.records32.push_back(s);
+        c.records16le.push_back(
+            miniutf::utf8_to_utf16_bytes(c.records.back(), miniutf::byte_order::little_endian));
+        c.records_latin1.push_back(miniutf::utf8_to_latin1(c.records.back()));
+        c.bytes += c.records.back().size();
+        c.codepoints += s.size();
+    }
+    return c;
+}
+
+static std::function<void (std::mt19937 &, std::u32string &)> range(char32_t lo, char32_t hi) {
+    return [=] (std::mt19937 & gen, std::u32string & s) {
+        s += std::uniform_int_distribution<char32_t>(lo, hi)(gen);
+    };
+}
+
+static std::vector<corpus> make_corpora() {
+    std::vector<corpus> out;
+    out.push_back(make_corpus("ascii", range('!', '~')));
+    out.push_back(make_corpus("latin1", [] (std::mt19937 & gen, std::u32string & s) {
+        s += (gen() % 3) ? std::uniform_int_distribution<char32_t>('a', 'z')(gen)
+                         : std::uniform_int_distribution<char32_t>(0xC0, 0xFF)(gen);
+    }));
+    out.push_back(make_corpus("greek", range(0x391, 0x3CE)));
+    out.push_back(make_corpus("cyrillic", range(0x410, 0x44F)));
+    out.push_back(make_corpus("cjk", range(0x4E00, 0x9FCC)));
+    out.push_back(make_corpus("hangul", range(0xAC00, 0xD7A3)));
+    out.push_back(make_corpus("emoji", range(0x1F300, 0x1F64F)));
+    out.push_back(make_corpus("mixed", [] (std::mt19937 & gen, std::u32string & s) {
+        // Every codepoint from a different script, so sequence lengths are unpredictable.
+        static const char32_t ranges[][2] = {
+            { 'a', 'z' }, { 0xC0, 0xFF }, { 0x391, 0x3CE }, { 0x4E00, 0x9FCC },
+            { 0x1F300, 0x1F64F },
+        };
+        const char32_t * r = ranges[gen() % 5];
+        s += std::uniform_int_distribution<char32_t>(r[0], r[1])(gen);
+    }));
+    out.push_back(make_corpus("combining", [] (std::mt19937 & gen, std::u32string & s) {
+        // A base letter followed by a long run of combining marks that need reordering.
+        s += std::uniform_int_distribution<char32_t>('a', 'z')(gen);
+        int marks = std::uniform_int_distribution<>(4, 24)(gen);
+        for (int i = 0; i < marks; i++)
+            s += std::uniform_int_distribution<char32_t>(0x300, 0x36F)(gen);
+    }));
+    return out;
+}
+
+/* * * * * * * * * *
+ * Timing
+ * * * * * * * * * */
+
+static volatile size_t sink;
+
+#ifdef MINIUTF_DFA_DECODER
+static const char * const decoder = "dfa";
+#else
+static const char * const decoder = "branchy";
+#endif
+
+/*
+ * Run fn over every record of c repeatedly for at least min_seconds, and print the results.
+ */
+static void run(const char * function, const corpus & c,
+                const std::function<size_t (size_t)> & fn, double min_seconds = 0.2) {
+    typedef std::chrono::steady_clock clock;
+
+    // Warm up.
+    for (size_t i = 0; i < c.records.size(); i++)
+        sink += fn(i);
+
+    unsigned long long iterations = 0, allocations = allocation_count.load();
+    auto start = clock::now();
+    double elapsed = 0;
+    size_t total = 0;
+    do {
+        for (size_t i = 0; i < c.records.size(); i++)
+            total += fn(i);
+        iterations++;
+        elapsed = std::chrono::duration<double>(clock::now() - start).count();
+    } while (elapsed < min_seconds);
+    allocations = allocation_count.load() - allocations;
+    sink += total;
+
+    double calls = double(iterations) * c.records.size();
+    printf("{\"function\": \"%s\", \"corpus\": \"%s\", \"calls\": %.0f, \"ns_per_call\": %.1f, "
+           "\"bytes_per_sec\": %.0f, \"codepoints_per_sec\": %.0f, \"allocs_per_call\": %.2f, "
+           "\"layout\": \"%s\", \"data_bytes\": %d, \"decoder\": \"%s\"}\n",
+           function, c.name.c_str(), calls, elapsed * 1e9 / calls,
+           iterations * c.bytes / elapsed, iterations * c.codepoints / elapsed,
+           allocations / calls, MINIUTF_TRIE_LAYOUT, MINIUTF_DATA_BYTES, decoder);
+    std::fflush(stdout);
+}
+
+int main(int argc, char ** argv) {
+    const std::vector<corpus> corpora = make_corpora();
+
+    struct benchmark {
+        const char * name;
+        std::function<size_t (const corpus &, size_t)> fn;
+    };
+
+    const std::vector<benchmark> benchmarks {
+        { "utf8_check", [] (const corpus & c, size_t i) {
+            return size_t(miniutf::utf8_check(c.records[i])); } },
+        { "utf32_check", [] (const corpus & c, size_t i) {
+            return size_t(miniutf::utf32_check(c.records32[i])); } },
+        { "utf8_decode_loop", [] (const corpus & c, size_t i) {
+            const string & s = c.records[i];
+            size_t sum = 0;
+            for (size_t pos = 0; pos < s.size(); )
+                sum += miniutf::utf8_decode(s, pos);
+            return sum; } },
+        { "utf8_iterator", [] (const corpus & c, size_t i) {
+            size_t sum = 0;
+            for (char32_t pt : miniutf::codepoints(c.records[i]))
+                sum += pt;
+            return sum; } },
+        { "utf8_iterator_reverse", [] (const corpus & c, size_t i) {
+            const auto r = miniutf::codepoints(c.records[i]);
+            size_t sum = 0;
+            for (auto it = r.end(); it != r.begin(); )
+                sum += *--it;
+            return sum; } },
+        { "count_codepoints", [] (const corpus & c, size_t i) {
+            return miniutf::count_codepoints(c.records[i]); } },
+        { "utf16_length", [] (const corpus & c, size_t i) {
+            return miniutf::utf16_length(c.records[i]); } },
+        { "to_utf16", [] (const corpus & c, size_t i) {
+            return miniutf::to_utf16(c.records[i]).size(); } },
+        { "to_utf32", [] (const corpus & c, size_t i) {
+            return miniutf::to_utf32(c.records[i]).size(); } },
+        { "to_utf8_from_utf16", [] (const corpus & c, size_t i) {
+            return miniutf::to_utf8(c.records16[i]).size(); } },
+        { "to_utf8_from_utf32", [] (const corpus & c, size_t i) {
+            return miniutf::to_utf8(c.records32[i]).size(); } },
+        { "utf16le_to_utf8", [] (const corpus & c, size_t i) {
+            const string & s = c.records16le[i];
+            return miniutf::utf16_bytes_to_utf8(s.data(), s.size(),
+                                                miniutf::byte_order::little_endian).size(); } },
+        { "utf8_to_utf16le", [] (const corpus & c, size_t i) {
+            return miniutf::utf8_to_utf16_bytes(c.records[i],
+                                                miniutf::byte_order::little_endian).size(); } },
+        { "latin1_to_utf8", [] (const corpus & c, size_t i) {
+            return miniutf::latin1_to_utf8(c.records_latin1[i]).size(); } },
+        { "cp1252_to_utf8", [] (const corpus & c, size_t i) {
+            return miniutf::cp1252_to_utf8(c.records_latin1[i]).size(); } },
+        { "utf8_to_latin1", [] (const corpus & c, size_t i) {
+            return miniutf::utf8_to_latin1(c.records[i]).size(); } },
+        { "fits_latin1", [] (const corpus & c, size_t i) {
+            return size_t(miniutf::fits_latin1(c.records[i])); } },
+        { "utf16_to_wtf8", [] (const corpus & c, size_t i) {
+            return miniutf::utf16_to_wtf8(c.records16[i]).size(); } },
+        { "utf8_to_cesu8", [] (const corpus & c, size_t i) {
+            return miniutf::utf8_to_cesu8(c.records[i]).size(); } },
+        { "utf8_to_mutf8", [] (const corpus & c, size_t i) {
+            return miniutf::utf8_to_mutf8(c.records[i]).size(); } },
+        { "lowercase", [] (const corpus & c, size_t i) {
+            return miniutf::lowercase(c.records[i]).size(); } },
+        { "nfc", [] (const corpus & c, size_t i) {
+            return miniutf::nfc(c.records[i]).size(); } },
+        { "nfd", [] (const corpus & c, size_t i) {
+            return miniutf::nfd(c.records[i]).size(); } },
+        { "normalize_path", [] (const corpus & c, size_t i) {
+            return miniutf::normalize_path(c.records[i], miniutf::path_form::nfc).size(); } },
+#ifdef MINIUTF_CONFUSABLES
+        { "skeleton", [] (const corpus & c, size_t i) {
+            return miniutf::skeleton(c.records[i]).size(); } },
+#endif
+        { "display_width", [] (const corpus & c, size_t i) {
+            return miniutf::display_width(c.records[i]); } },
+        // What display_width replaces: decoding to UTF-32 first, then a lookup per codepoint.
+        { "display_width_utf32", [] (const corpus & c, size_t i) {
+            size_t width = 0;
+            for (char32_t pt : miniutf::to_utf32(c.records[i]))
+                width += miniutf::codepoint_width(pt);
+            return width; } },
+        { "truncate_width", [] (const corpus & c, size_t i) {
+            return miniutf::truncate_width(c.records[i], 20); } },
+        // The whole corpus in one call, on its first record, so that ns_per_call is per record
+        // as for nfc. The output's storage is reused from one pass to the next.
+        { "nfc_batch", [] (const corpus & c, size_t i) {
+            static miniutf::normalized_batch out;
+            if (i == 0)
+                miniutf::normalize_batch(c.records, true, out);
+            return i == 0 ? out.data.size() : 0; } },
+        // The whole corpus into a presized index, on its first record as for nfc_batch.
+        { "name_index_build", [] (const corpus & c, size_t i) {
+            static miniutf::folded_name_index index;
+            if (i == 0) {
+                index = miniutf::folded_name_index();
+                index.reserve(c.records.size(), c.bytes);
+                for (size_t j = 0; j < c.records.size(); j++)
+                    index.insert(c.records[j], j);
+            }
+            return i == 0 ? index.size() : 0; } },
+        // Each record looked up in an index of the whole corpus, built once per corpus.
+        { "name_index_find", [] (const corpus & c, size_t i) {
+            static miniutf::folded_name_index index;
+            static const corpus * indexed = nullptr;
+            if (indexed != &c) {
+                index = miniutf::folded_name_index();
+                for (size_t j = 0; j < c.records.size(); j++)
+                    index.insert(c.records[j], j);
+                indexed = &c;
+            }
+            return index.find(c.records[i]).size(); } },
+        // The allocator-aware variants, into a fresh arena for each call.
+        { "to_utf16_arena", [] (const corpus & c, size_t i) {
+            request_arena.reset();
+            arena_u16string out;
+            miniutf::to_utf16(c.records[i], out);
+            return out.size(); } },
+        { "lowercase_arena", [] (const corpus & c, size_t i) {
+            request_arena.reset();
+            arena_string out;
+            miniutf::lowercase(c.records[i], out);
+            return out.size(); } },
+        { "nfc_arena", [] (const corpus & c, size_t i) {
+            request_arena.reset();
+            arena_string out;
+            miniutf::nfc(c.records[i], out);
+            return out.size(); } },
+        { "match_key", [] (const corpus & c, size_t i) {
+            return miniutf::match_key(c.records[i]).size(); } },
+        // The same context for every call, as in a loop.
+        { "nfc_context", [] (const corpus & c, size_t i) {
+            static miniutf::context ctx;
+            return miniutf::nfc(c.records[i], ctx).size(); } },
+        { "match_key_context", [] (const corpus & c, size_t i) {
+            static miniutf::context ctx;
+            return miniutf::match_key(c.records[i], ctx).size(); } },
+        { "grapheme_next", [] (const corpus & c, size_t i) {
+            const string & s = c.records[i];
+            size_t clusters = 0;
+            for (size_t pos = 0; pos < s.size(); pos = miniutf::grapheme_next(s, pos))
+                clusters++;
+            return clusters; } },
+        { "trie_lookup", [] (const corpus & c, size_t i) {
+            size_t total = 0;
+            for (char32_t pt : c.records32[i])
+                total += data::ccc(pt) + data::lowercase_offset(pt)
+                         + data::decomp_idx(pt) + data::comp_idx(pt);
+            return total; } },
+    };
+
+    for (const benchmark & b : benchmarks) {
+        for (const corpus & c : corpora) {
+            bool selected = (argc < 2);
+            for (int i = 1; i < argc; i++) {
+                if (std::strstr(b.name, argv[i]) || c.name.find(argv[i]) != string::npos)
+                    selected = true;
+            }
+            if (selected)
+                run(b.name, c, [&] (size_t i) { return b.fn(c, i); });
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,4 @@
+#!/bin/sh
+curl http://www.unicode.org/Public/6.3.0/ucd/EastAsianWidth.txt > EastAsianWidth.txt
+curl http://www.unicode.org/Public/6.3.0/ucd/auxiliary/GraphemeBreakProperty.txt > GraphemeBreakProperty.txt
+curl http://www.unicode.org/Public/6.3.0/ucd/auxiliary/GraphemeBreakTest.txt > GraphemeBreakTest.txt
@@ -0,0 +1,2 @@
+#!/bin/sh
+curl http://www.unicode.org/Public/security/6.3.0/confusables.txt > confusables.txt
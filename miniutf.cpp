@@ -20,50 +20,107 @@
  */
 
 #include "miniutf.hpp"
+#include "miniutf_stats.hpp"
 
 #include <algorithm>
+#include <cstring>
+#include <exception>
+#include <system_error>
+#include <thread>
 
 namespace miniutf {
 
 #include "miniutfdata.h"
 
+// The lookups are constant expressions, so callers can have them inlined or folded.
+static_assert(ccc(0x0301) == 230 && lowercase_offset('A') == 32, "bad Unicode data tables");
+
+/* * * * * * * * * *
+ * Instrumentation
+ * * * * * * * * * */
+
+#ifdef MINIUTF_STATS
+MINIUTF_INLINE
+stats & thread_stats() {
+    static thread_local stats counters;
+    return counters;
+}
+#endif
+
+MINIUTF_INLINE
+stats stats_snapshot() {
+#ifdef MINIUTF_STATS
+    return thread_stats();
+#else
+    return stats();
+#endif
+}
+
+MINIUTF_INLINE
+void stats_reset() {
+#ifdef MINIUTF_STATS
+    thread_stats() = stats();
+#endif
+}
+
 /* * * * * * * * * *
  * Encoding
  * * * * * * * * * */
 
-void utf8_encode(char32_t pt, std::string & out) {
+MINIUTF_INLINE
+int utf8_encode(char32_t pt, char * out) {
     if (pt < 0x80) {
-        out += static_cast<char>(pt);
+        out[0] = static_cast<char>(pt);
+        return 1;
     } else if (pt < 0x800) {
-        out += { static_cast<char>((pt >> 6)   | 0xC0),
-                 static_cast<char>((pt & 0x3F) | 0x80) };
+        out[0] = static_cast<char>((pt >> 6)   | 0xC0);
+        out[1] = static_cast<char>((pt & 0x3F) | 0x80);
+        return 2;
     } else if (pt < 0x10000) {
-        out += { static_cast<char>((pt >> 12)         | 0xE0),
-                 static_cast<char>(((pt >> 6) & 0x3F) | 0x80),
-                 static_cast<char>((pt & 0x3F)        | 0x80) };
+        out[0] = static_cast<char>((pt >> 12)         | 0xE0);
+        out[1] = static_cast<char>(((pt >> 6) & 0x3F) | 0x80);
+        out[2] = static_cast<char>((pt & 0x3F)        | 0x80);
+        return 3;
     } else if (pt < 0x110000) {
-        out += { static_cast<char>((pt >> 18)          | 0xF0),
-                 static_cast<char>(((pt >> 12) & 0x3F) | 0x80),
-                 static_cast<char>(((pt >> 6)  & 0x3F) | 0x80),
-                 static_cast<char>((pt & 0x3F)         | 0x80) };
+        out[0] = static_cast<char>((pt >> 18)          | 0xF0);
+        out[1] = static_cast<char>(((pt >> 12) & 0x3F) | 0x80);
+        out[2] = static_cast<char>(((pt >> 6)  & 0x3F) | 0x80);
+        out[3] = static_cast<char>((pt & 0x3F)         | 0x80);
+        return 4;
     } else {
-        out += { static_cast<char>(0xEF),
-                 static_cast<char>(0xBF),
-                 static_cast<char>(0xBD) }; // U+FFFD
+        return utf8_encode(0xFFFD, out);
     }
 }
 
-void utf16_encode(char32_t pt, std::u16string & out) {
+MINIUTF_INLINE
+int utf16_encode(char32_t pt, char16_t * out) {
     if (pt < 0x10000) {
-        out += static_cast<char16_t>(pt);
+        out[0] = static_cast<char16_t>(pt);
+        return 1;
     } else if (pt < 0x110000) {
-        out += { static_cast<char16_t>(((pt - 0x10000) >> 10) + 0xD800),
-                 static_cast<char16_t>((pt & 0x3FF) + 0xDC00) };
+        out[0] = static_cast<char16_t>(((pt - 0x10000) >> 10) + 0xD800);
+        out[1] = static_cast<char16_t>((pt & 0x3FF) + 0xDC00);
+        return 2;
     } else {
-        out += 0xFFFD;
+        out[0] = 0xFFFD;
+        return 1;
     }
 }
 
+MINIUTF_INLINE
+void utf8_encode(char32_t pt, std::string & out) {
+    MINIUTF_STAT_GROWTH(out);
+    char buf[4];
+    out.append(buf, utf8_encode(pt, buf));
+}
+
+MINIUTF_INLINE
+void utf16_encode(char32_t pt, std::u16string & out) {
+    MINIUTF_STAT_GROWTH(out);
+    char16_t buf[2];
+    out.append(buf, utf16_encode(pt, buf));
+}
+
 /* * * * * * * * * *
  * Decoding logic
  * * * * * * * * * */
@@ -73,104 +130,209 @@ struct offset_pt {
     char32_t pt;
 };
 
-static constexpr const offset_pt invalid_pt = { -1, 0 };
+// A function rather than a constant, so that copying it out of an inline function doesn't
+// refer to an object with internal linkage.
+constexpr offset_pt invalid_pt() { return { -1, 0 }; }
+
+#ifdef MINIUTF_DFA_DECODER
 
 /*
- * Decode a codepoint starting at str[i], and return the number of code units (bytes, for
- * UTF-8) consumed and the result. If no valid codepoint is at str[i], return invalid_pt.
+ * A table-driven UTF-8 decoder, after Bjoern Hoehrmann's: each byte is mapped to a class, and
+ * the class and the current state pick the next state, so there's one data-dependent branch
+ * per byte rather than a tree of them per lead byte. It accepts exactly what the decoder in
+ * the #else branch does, including encoded surrogates. Only ASCII is special-cased.
  */
-static offset_pt utf8_decode_check(const std::string & str, std::string::size_type i) {
+
+// Byte classes: 0 is 00..7F, 1 is 80..8F, 2 is 90..9F, 3 is A0..BF, 4 is C2..DF, 5 is E0,
+// 6 is E1..EF, 7 is F0, 8 is F1..F3, 9 is F4, and 10 is C0, C1 and F5..FF, which are never
+// valid.
+MINIUTF_DATA_TABLE(, uint8_t, dfa_byte_class) {
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  // 00
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  // 10
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  // 20
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  // 30
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  // 40
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  // 50
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  // 60
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  // 70
+     1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  // 80
+     2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  // 90
+     3,  3,  3,  3,  3,  3,  3,  3,  3,  3,  3,  3,  3,  3,  3,  3,  // A0
+     3,  3,  3,  3,  3,  3,  3,  3,  3,  3,  3,  3,  3,  3,  3,  3,  // B0
+    10, 10,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  // C0
+     4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  // D0
+     5,  6,  6,  6,  6,  6,  6,  6,  6,  6,  6,  6,  6,  6,  6,  6,  // E0
+     7,  8,  8,  8,  9, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10,  // F0
+};
+MINIUTF_DATA_TABLE_END(, uint8_t, dfa_byte_class)
+
+// The bits of a lead byte that belong to the codepoint, by class.
+MINIUTF_DATA_TABLE(, uint8_t, dfa_lead_mask) {
+    0x7F, 0, 0, 0, 0x1F, 0x0F, 0x0F, 0x07, 0x07, 0x07, 0,
+};
+MINIUTF_DATA_TABLE_END(, uint8_t, dfa_lead_mask)
+
+// States. All but accept and reject are waiting for continuation bytes: need_n for n more of
+// any value, and after_e0, after_f0 and after_f4 for a second byte in the narrower range that
+// rules out overlong encodings and codepoints above U+10FFFF.
+enum : uint8_t {
+    dfa_accept, dfa_reject, dfa_need_1, dfa_need_2, dfa_need_3,
+    dfa_after_e0, dfa_after_f0, dfa_after_f4,
+};
+
+typedef uint8_t dfa_row[11];
+
+MINIUTF_DATA_TABLE(, dfa_row, dfa_transitions) {
+#define R dfa_reject
+    // accept: a lead byte picks how many continuation bytes follow
+    { dfa_accept, R, R, R, dfa_need_1, dfa_after_e0, dfa_need_2,
+      dfa_after_f0, dfa_need_3, dfa_after_f4, R },
+    // reject (never consulted)
+    { R, R, R, R, R, R, R, R, R, R, R },
+    { R, dfa_accept, dfa_accept, dfa_accept, R, R, R, R, R, R, R },
+    { R, dfa_need_1, dfa_need_1, dfa_need_1, R, R, R, R, R, R, R },
+    { R, dfa_need_2, dfa_need_2, dfa_need_2, R, R, R, R, R, R, R },
+    { R, R, R, dfa_need_1, R, R, R, R, R, R, R },
+    { R, R, dfa_need_2, dfa_need_2, R, R, R, R, R, R, R },
+    { R, dfa_need_2, R, R, R, R, R, R, R, R, R },
+#undef R
+};
+MINIUTF_DATA_TABLE_END(, dfa_row, dfa_transitions)
+
+MINIUTF_LOCAL
+offset_pt utf8_decode_check_at(const char * s) {
+    // NUL rejects any state waiting for a continuation byte, so this stops at a terminator.
+    const unsigned char * p = reinterpret_cast<const unsigned char *>(s);
+    if (p[0] < 0x80)
+        return { 1, p[0] };
+    uint8_t type = dfa_byte_class[p[0]];
+    char32_t pt = p[0] & dfa_lead_mask[type];
+    uint8_t state = dfa_transitions[dfa_accept][type];
+    int n = 1;
+    while (state > dfa_reject) {
+        pt = (pt << 6) | (p[n] & 0x3F);
+        state = dfa_transitions[state][dfa_byte_class[p[n]]];
+        n++;
+    }
+    if (state == dfa_reject)
+        return invalid_pt();
+    return { n, pt };
+}
+
+#else
+
+/*
+ * Decode a codepoint starting at s, and return the number of code units (bytes, for UTF-8)
+ * consumed and the result. If no valid codepoint is at s, return invalid_pt(). This reads up to
+ * the first byte that isn't a continuation byte, or 4 bytes, so s must be NUL-terminated (as
+ * std::string is) or have 4 bytes left.
+ */
+MINIUTF_LOCAL
+offset_pt utf8_decode_check_at(const char * s) {
     uint32_t b0, b1, b2, b3;
 
-    b0 = static_cast<unsigned char>(str[i]);
+    b0 = static_cast<unsigned char>(s[0]);
 
     if (b0 < 0x80) {
         // 1-byte character
         return { 1, b0 };
     } else if (b0 < 0xC0) {
         // Unexpected continuation byte
-        return invalid_pt;
+        return invalid_pt();
     } else if (b0 < 0xE0) {
         // 2-byte character
-        if (((b1 = str[i+1]) & 0xC0) != 0x80)
-            return invalid_pt;
+        if (((b1 = s[1]) & 0xC0) != 0x80)
+            return invalid_pt();
 
         char32_t pt = (b0 & 0x1F) << 6 | (b1 & 0x3F);
         if (pt < 0x80)
-            return invalid_pt;
+            return invalid_pt();
 
         return { 2, pt };
     } else if (b0 < 0xF0) {
         // 3-byte character
-        if (((b1 = str[i+1]) & 0xC0) != 0x80)
-            return invalid_pt;
-        if (((b2 = str[i+2]) & 0xC0) != 0x80)
-            return invalid_pt;
+        if (((b1 = s[1]) & 0xC0) != 0x80)
+            return invalid_pt();
+        if (((b2 = s[2]) & 0xC0) != 0x80)
+            return invalid_pt();
 
         char32_t pt = (b0 & 0x0F) << 12 | (b1 & 0x3F) << 6 | (b2 & 0x3F);
         if (pt < 0x800)
-            return invalid_pt;
+            return invalid_pt();
 
         return { 3, pt };
     } else if (b0 < 0xF8) {
         // 4-byte character
-        if (((b1 = str[i+1]) & 0xC0) != 0x80)
-            return invalid_pt;
-        if (((b2 = str[i+2]) & 0xC0) != 0x80)
-            return invalid_pt;
-        if (((b3 = str[i+3]) & 0xC0) != 0x80)
-            return invalid_pt;
+        if (((b1 = s[1]) & 0xC0) != 0x80)
+            return invalid_pt();
+        if (((b2 = s[2]) & 0xC0) != 0x80)
+            return invalid_pt();
+        if (((b3 = s[3]) & 0xC0) != 0x80)
+            return invalid_pt();
 
         char32_t pt = (b0 & 0x0F) << 18 | (b1 & 0x3F) << 12
                     | (b2 & 0x3F) << 6  | (b3 & 0x3F);
         if (pt < 0x10000 || pt >= 0x110000)
-            return invalid_pt;
+            return invalid_pt();
 
         return { 4, pt };
     } else {
         // Codepoint out of range
-        return invalid_pt;
+        return invalid_pt();
     }
 }
 
+#endif
+
+MINIUTF_LOCAL
+offset_pt utf8_decode_check(const std::string & str, std::string::size_type i) {
+    return utf8_decode_check_at(str.data() + i);
+}
+
+/*
+ * Like utf8_decode_check_at, but for a buffer [s, end) that may not be NUL-terminated.
+ */
+MINIUTF_LOCAL
+offset_pt utf8_decode_check_bounded(const char * s, const char * end) {
+    if (end - s >= 4)
+        return utf8_decode_check_at(s);
+
+    // Near the end, decode from a zero-padded copy.
+    char buf[4] = {};
+    std::memcpy(buf, s, end - s);
+    return utf8_decode_check_at(buf);
+}
+
 // UTF-16 decode helpers.
-static inline bool is_high_surrogate(char16_t c) { return (c >= 0xD800) && (c < 0xDC00); }
-static inline bool is_low_surrogate(char16_t c)  { return (c >= 0xDC00) && (c < 0xE000); }
+MINIUTF_LOCAL bool is_high_surrogate(char16_t c) { return (c >= 0xD800) && (c < 0xDC00); }
+MINIUTF_LOCAL bool is_low_surrogate(char16_t c)  { return (c >= 0xDC00) && (c < 0xE000); }
 
 /*
  * Like utf8_decode_check, but for UTF-16.
  */
-static offset_pt utf16_decode_check(const std::u16string & str, std::u16string::size_type i) {
+MINIUTF_LOCAL
+offset_pt utf16_decode_check(const std::u16string & str, std::u16string::size_type i) {
     if (is_high_surrogate(str[i]) && is_low_surrogate(str[i+1])) {
         // High surrogate followed by low surrogate
         char32_t pt = (((str[i] - 0xD800) << 10) | (str[i+1] - 0xDC00)) + 0x10000;
         return { 2, pt };
     } else if (is_high_surrogate(str[i]) || is_low_surrogate(str[i])) {
         // High surrogate *not* followed by low surrogate, or unpaired low surrogate
-        return invalid_pt;
+        return invalid_pt();
     } else {
         return { 1, str[i] };
     }
 }
 
-/*
- * UTF-32 is very easy to check.
- */
-static offset_pt utf32_decode_check(const std::u32string & str, std::u32string::size_type i) {
-    if (str[i] < 0x110000) {
-        return { 1, str[i] };
-    } else {
-        return invalid_pt;
-    }
-}
-
 /* * * * * * * * * *
  * Decoding wrappers
  * * * * * * * * * */
 
+MINIUTF_INLINE
 char32_t utf8_decode(const std::string & str, std::string::size_type & i,
                                               bool * replacement_flag) {
     offset_pt res = utf8_decode_check(str, i);
+    MINIUTF_STAT(bytes_decoded, res.offset < 0 ? 1 : res.offset);
     if (res.offset < 0) {
         if (replacement_flag)
             *replacement_flag = true;
@@ -182,6 +344,7 @@ char32_t utf8_decode(const std::string & str, std::string::size_type & i,
     }
 }
 
+MINIUTF_INLINE
 char32_t utf16_decode(const std::u16string & str, std::u16string::size_type & i,
                                                   bool * replacement_flag) {
     offset_pt res = utf16_decode_check(str, i);
@@ -196,6 +359,70 @@ char32_t utf16_decode(const std::u16string & str, std::u16string::size_type & i,
     }
 }
 
+MINIUTF_INLINE
+char32_t utf8_decode(const char *& p, const char * end, bool * replacement_flag) {
+    offset_pt res = utf8_decode_check_bounded(p, end);
+    MINIUTF_STAT(bytes_decoded, res.offset < 0 ? 1 : res.offset);
+    if (res.offset < 0) {
+        if (replacement_flag)
+            *replacement_flag = true;
+        p += 1;
+        return 0xFFFD;
+    } else {
+        p += res.offset;
+        return res.pt;
+    }
+}
+
+MINIUTF_INLINE
+char32_t utf16_decode(const char16_t *& p, const char16_t * end, bool * replacement_flag) {
+    const char16_t c = *p++;
+    if (is_high_surrogate(c) && p != end && is_low_surrogate(*p))
+        return (((c - 0xD800) << 10) | (*p++ - 0xDC00)) + 0x10000;
+    if (is_high_surrogate(c) || is_low_surrogate(c)) {
+        if (replacement_flag)
+            *replacement_flag = true;
+        return 0xFFFD;
+    }
+    return c;
+}
+
+MINIUTF_INLINE
+char32_t utf8_decode_prev(const char *& p, const char * begin, bool * replacement_flag) {
+    // Back up over at most three continuation bytes to a lead byte, and use it only if the
+    // sequence it starts ends exactly at p. Otherwise p[-1] is an invalid byte by itself,
+    // just as when decoding forwards.
+    const char * start = p - 1;
+    while (start > begin && p - start < 4 && (static_cast<unsigned char>(*start) & 0xC0) == 0x80)
+        start--;
+
+    const offset_pt res = utf8_decode_check_bounded(start, p);
+    MINIUTF_STAT(bytes_decoded, res.offset < 0 ? 1 : res.offset);
+    if (res.offset > 0 && start + res.offset == p) {
+        p = start;
+        return res.pt;
+    }
+    if (replacement_flag)
+        *replacement_flag = true;
+    p -= 1;
+    return 0xFFFD;
+}
+
+MINIUTF_INLINE
+char32_t utf16_decode_prev(const char16_t *& p, const char16_t * begin, bool * replacement_flag) {
+    const char16_t c = *--p;
+    if (is_low_surrogate(c) && p != begin && is_high_surrogate(p[-1])) {
+        const char16_t high = *--p;
+        return (((high - 0xD800) << 10) | (c - 0xDC00)) + 0x10000;
+    }
+    if (is_high_surrogate(c) || is_low_surrogate(c)) {
+        if (replacement_flag)
+            *replacement_flag = true;
+        return 0xFFFD;
+    }
+    return c;
+}
+
 /* * * * * * * * * *
  * Checking
  * * * * * * * * * */
@@ -211,60 +438,663 @@ bool check_helper(const Tfunc & func, const Tstring & str) {
     return true;
 }
 
-bool utf8_check (const    std::string & str) { return check_helper(utf8_decode_check,  str); }
+MINIUTF_INLINE
+bool utf8_check (const    std::string & str) {
+    MINIUTF_STAT(bytes_decoded, str.length());
+    return check_helper(utf8_decode_check, str);
+}
+MINIUTF_INLINE
 bool utf16_check(const std::u16string & str) { return check_helper(utf16_decode_check, str); }
-bool utf32_check(const std::u32string & str) { return check_helper(utf32_decode_check, str); }
+
+/*
+ * There's nothing to decode in UTF-32, so just look for anything out of range, in blocks with
+ * no early exit so that the compiler can vectorize the comparisons.
+ */
+MINIUTF_INLINE
+bool utf32_check(const std::u32string & str) {
+    const size_t block = 64;
+    const char32_t * data = str.data();
+    for (size_t i = 0; i < str.size(); i += block) {
+        const size_t end = std::min(str.size(), i + block);
+        char32_t bad = 0;
+        for (size_t j = i; j < end; j++)
+            bad |= data[j] >= 0x110000;
+        if (bad)
+            return false;
+    }
+    return true;
+}
 
 /* * * * * * * * * *
  * Conversion
  * * * * * * * * * */
 
+MINIUTF_INLINE
 std::u32string to_utf32(const std::string & str) {
     std::u32string out;
-    out.reserve(str.length()); // likely overallocate
-    for (std::string::size_type i = 0; i < str.length(); )
+    counted_reserve(out, str.length()); // likely overallocate
+    for (std::string::size_type i = 0; i < str.length(); ) {
+        MINIUTF_STAT_GROWTH(out);
         out += utf8_decode(str, i);
+    }
     return out;
 }
 
-std::u16string to_utf16(const std::string & str) {
+MINIUTF_INLINE
+std::u16string to_utf16(const std::string & str, bool * replacement_flag) {
     std::u16string out;
-    out.reserve(str.length()); // likely overallocate
+    counted_reserve(out, str.length()); // likely overallocate
     for (std::string::size_type i = 0; i < str.length(); )
-        utf16_encode(utf8_decode(str, i), out);
+        utf16_encode(utf8_decode(str, i, replacement_flag), out);
     return out;
 }
 
+MINIUTF_INLINE
 std::string to_utf8(const std::u16string & str) {
     std::string out;
-    out.reserve(str.length() * 3 / 2); // estimate
+    counted_reserve(out, str.length() * 3 / 2); // estimate
     for (std::u16string::size_type i = 0; i < str.length(); )
         utf8_encode(utf16_decode(str, i), out);
     return out;
 }
 
+/*
+ * The length of str in UTF-8, with anything out of range counted as U+FFFD. This has no
+ * branches, so it vectorizes.
+ */
+MINIUTF_LOCAL
+size_t utf8_length(const std::u32string & str) {
+    size_t length = 0;
+    for (char32_t pt : str) {
+        length += 1 + (pt >= 0x80) + (pt >= 0x800) + (pt >= 0x10000)
+                    - (pt >= 0x110000); // U+FFFD takes 3 bytes
+    }
+    return length;
+}
+
+MINIUTF_INLINE
 std::string to_utf8(const std::u32string & str) {
+    // Size the output exactly, and then write it without checking for space.
+    std::string out;
+    {
+        MINIUTF_STAT_GROWTH(out);
+        out.resize(utf8_length(str));
+    }
+    char * p = &out[0];
+    for (char32_t pt : str) {
+        if (pt < 0x80)
+            *p++ = static_cast<char>(pt);
+        else
+            p += utf8_encode(pt, p);
+    }
+    return out;
+}
+
+/* * * * * * * * * *
+ * Counting
+ * * * * * * * * * */
+
+// Is the 8-byte word at p all ASCII?
+MINIUTF_LOCAL bool is_ascii_word(const char * p) {
+    uint64_t word;
+    std::memcpy(&word, p, sizeof(word));
+    return !(word & 0x8080808080808080ULL);
+}
+
+/*
+ * Return the length of the UTF-8 sequence starting at p (which must not be ASCII), or 1 if it
+ * isn't valid. This accepts exactly what utf8_decode_check does, but without computing the
+ * codepoint. Like utf8_decode_check, it relies on the string being NUL-terminated.
+ */
+MINIUTF_LOCAL int utf8_sequence_length(const unsigned char * p) {
+    const unsigned char b0 = p[0];
+    if (b0 < 0xC2) {
+        // Continuation byte, or the start of an overlong 2-byte sequence
+        return 1;
+    } else if (b0 < 0xE0) {
+        return (p[1] & 0xC0) == 0x80 ? 2 : 1;
+    } else if (b0 < 0xF0) {
+        if ((p[1] & 0xC0) != 0x80 || (p[2] & 0xC0) != 0x80 || (b0 == 0xE0 && p[1] < 0xA0))
+            return 1;
+        return 3;
+    } else if (b0 < 0xF5) {
+        if ((p[1] & 0xC0) != 0x80 || (p[2] & 0xC0) != 0x80 || (p[3] & 0xC0) != 0x80
+            || (b0 == 0xF0 && p[1] < 0x90) || (b0 == 0xF4 && p[1] >= 0x90))
+            return 1;
+        return 4;
+    } else {
+        return 1;
+    }
+}
+
+/*
+ * Count the codepoints in str, and how many of them are outside the BMP (and so take two
+ * UTF-16 code units), just as decoding would count them. ASCII is skipped over 32 or 8 bytes
+ * at a time; other sequences are only validated, not decoded.
+ */
+MINIUTF_LOCAL
+void count_utf8(const std::string & str, size_t & codepoints, size_t & supplementary) {
+    const char * data = str.data();
+    const size_t size = str.size();
+    size_t i = 0;
+    codepoints = supplementary = 0;
+
+    while (i < size) {
+        if (size - i >= 32 && is_ascii_word(data + i) && is_ascii_word(data + i + 8)
+            && is_ascii_word(data + i + 16) && is_ascii_word(data + i + 24)) {
+            i += 32;
+            codepoints += 32;
+            continue;
+        }
+        if (size - i >= 8 && is_ascii_word(data + i)) {
+            i += 8;
+            codepoints += 8;
+            continue;
+        }
+
+        // Count up to the next ASCII character, and then try for whole words again.
+        if (static_cast<unsigned char>(data[i]) < 0x80) {
+            i++;
+            codepoints++;
+        }
+        while (i < size && static_cast<unsigned char>(data[i]) >= 0x80) {
+            const int length =
+                utf8_sequence_length(reinterpret_cast<const unsigned char *>(data + i));
+            i += length;
+            codepoints++;
+            supplementary += (length == 4);
+        }
+    }
+    MINIUTF_STAT(bytes_decoded, size);
+}
+
+MINIUTF_INLINE
+std::string::size_type count_codepoints(const std::string & str) {
+    size_t codepoints, supplementary;
+    count_utf8(str, codepoints, supplementary);
+    return codepoints;
+}
+
+MINIUTF_INLINE
+std::string::size_type utf16_length(const std::string & str) {
+    size_t codepoints, supplementary;
+    count_utf8(str, codepoints, supplementary);
+    return codepoints + supplementary;
+}
+
+/* * * * * * * * * *
+ * UTF-16 byte streams
+ * * * * * * * * * */
+
+// Which bytes of each 8-byte word must be clear for it to be four ASCII characters.
+MINIUTF_DATA_TABLE(, unsigned char, utf16le_ascii_mask) {
+    0x80, 0xFF, 0x80, 0xFF, 0x80, 0xFF, 0x80, 0xFF,
+};
+MINIUTF_DATA_TABLE_END(, unsigned char, utf16le_ascii_mask)
+MINIUTF_DATA_TABLE(, unsigned char, utf16be_ascii_mask) {
+    0xFF, 0x80, 0xFF, 0x80, 0xFF, 0x80, 0xFF, 0x80,
+};
+MINIUTF_DATA_TABLE_END(, unsigned char, utf16be_ascii_mask)
+
+/*
+ * Is the 8-byte word at p four ASCII characters in UTF-16 of the given order?
+ */
+MINIUTF_LOCAL
+bool is_utf16_ascii_word(const char * p, byte_order order) {
+    uint64_t word, mask;
+    std::memcpy(&word, p, sizeof(word));
+    std::memcpy(&mask, order == byte_order::little_endian ? utf16le_ascii_mask
+                                                          : utf16be_ascii_mask, sizeof(mask));
+    return !(word & mask);
+}
+
+// The code unit at p.
+MINIUTF_LOCAL char16_t utf16_unit(const char * p, byte_order order) {
+    const unsigned char * b = reinterpret_cast<const unsigned char *>(p);
+    return order == byte_order::little_endian ? char16_t(b[0] | b[1] << 8)
+                                              : char16_t(b[0] << 8 | b[1]);
+}
+
+/*
+ * Decode the codepoint at byte i of data, which must have at least two bytes left, and
+ * return the number of bytes consumed and the result, or invalid_pt().
+ */
+MINIUTF_LOCAL
+offset_pt utf16_bytes_decode_check(const char * data, size_t size, size_t i, byte_order order) {
+    const char16_t c = utf16_unit(data + i, order);
+    const char16_t c2 = (size - i >= 4) ? utf16_unit(data + i + 2, order) : 0;
+    if (is_high_surrogate(c) && is_low_surrogate(c2)) {
+        return { 4, char32_t((((c - 0xD800) << 10) | (c2 - 0xDC00)) + 0x10000) };
+    } else if (is_high_surrogate(c) || is_low_surrogate(c)) {
+        return invalid_pt();
+    } else {
+        return { 2, c };
+    }
+}
+
+// Write the code unit c at p, and return the end of what was written.
+MINIUTF_LOCAL char * utf16_append_unit(char16_t c, byte_order order, char * p) {
+    p[0] = char(order == byte_order::little_endian ? c & 0xFF : c >> 8);
+    p[1] = char(order == byte_order::little_endian ? c >> 8 : c & 0xFF);
+    return p + 2;
+}
+
+MINIUTF_INLINE
+size_t utf16_detect_bom(const char * data, size_t size, byte_order & order) {
+    if (size >= 2 && utf16_unit(data, byte_order::little_endian) == 0xFEFF) {
+        order = byte_order::little_endian;
+        return 2;
+    } else if (size >= 2 && utf16_unit(data, byte_order::big_endian) == 0xFEFF) {
+        order = byte_order::big_endian;
+        return 2;
+    }
+    return 0;
+}
+
+MINIUTF_INLINE
+std::string utf16_bytes_to_utf8(const char * data, size_t size, byte_order order,
+                                bool * replacement_flag, size_t * error_offset) {
+    std::string out;
+    counted_reserve(out, size * 3 / 4); // estimate
+    if (error_offset)
+        *error_offset = std::string::npos;
+
+    const int low_byte = (order == byte_order::little_endian) ? 0 : 1;
+    size_t i = 0;
+    while (size - i >= 2) {
+        if (size - i >= 8 && is_utf16_ascii_word(data + i, order)) {
+            MINIUTF_STAT_GROWTH(out);
+            const char ascii[4] = { data[i + low_byte], data[i + 2 + low_byte],
+                                    data[i + 4 + low_byte], data[i + 6 + low_byte] };
+            out.append(ascii, 4);
+            i += 8;
+            continue;
+        }
+
+        // Convert up to and including the next ASCII character, and then try for whole words
+        // again.
+        while (size - i >= 2) {
+            offset_pt res = utf16_bytes_decode_check(data, size, i, order);
+            if (res.offset < 0) {
+                if (replacement_flag)
+                    *replacement_flag = true;
+                if (error_offset && *error_offset == std::string::npos)
+                    *error_offset = i;
+                res = { 2, 0xFFFD };
+            }
+            utf8_encode(res.pt, out);
+            i += res.offset;
+            if (res.pt < 0x80)
+                break;
+        }
+    }
+
+    if (i < size) {
+        if (replacement_flag)
+            *replacement_flag = true;
+        if (error_offset && *error_offset == std::string::npos)
+            *error_offset = i;
+        utf8_encode(0xFFFD, out);
+    }
+    return out;
+}
+
+MINIUTF_INLINE
+std::string utf8_to_utf16_bytes(const std::string & str, byte_order order, bool bom) {
+    // Each byte of UTF-8 becomes at most two bytes of UTF-16 (and four-byte sequences become
+    // exactly four), so size the output for that and trim it afterwards.
+    std::string out;
+    {
+        MINIUTF_STAT_GROWTH(out);
+        out.resize(str.size() * 2 + (bom ? 2 : 0));
+    }
+    char * p = &out[0];
+    if (bom)
+        p = utf16_append_unit(0xFEFF, order, p);
+
+    const int low_byte = (order == byte_order::little_endian) ? 0 : 1;
+    const char * data = str.data();
+    for (size_t i = 0; i < str.size(); ) {
+        if (str.size() - i >= 8 && is_ascii_word(data + i)) {
+            // Widen eight characters at once.
+            for (int j = 0; j < 8; j++) {
+                p[2 * j + low_byte] = data[i + j];
+                p[2 * j + 1 - low_byte] = 0;
+            }
+            p += 16;
+            i += 8;
+            continue;
+        }
+
+        char16_t units[2];
+        const int n = utf16_encode(utf8_decode(str, i), units);
+        for (int j = 0; j < n; j++)
+            p = utf16_append_unit(units[j], order, p);
+    }
+
+    out.resize(p - out.data());
+    return out;
+}
+
+MINIUTF_INLINE
+bool utf16_bytes_check(const char * data, size_t size, byte_order order, size_t * error_offset) {
+    size_t i = 0;
+    while (size - i >= 2) {
+        if (size - i >= 8 && is_utf16_ascii_word(data + i, order)) {
+            i += 8;
+            continue;
+        }
+        offset_pt res = utf16_bytes_decode_check(data, size, i, order);
+        if (res.offset < 0)
+            break;
+        i += res.offset;
+    }
+
+    if (i == size)
+        return true;
+    if (error_offset)
+        *error_offset = i;
+    return false;
+}
+
+/* * * * * * * * * *
+ * Single-byte encodings
+ * * * * * * * * * */
+
+// The codepoints of bytes 0x80 to 0x9F in Windows-1252. Its undefined bytes map to the C1
+// controls of the same value.
+MINIUTF_DATA_TABLE(, char16_t, cp1252_high) {
+    0x20AC, 0x0081, 0x201A, 0x0192, 0x201E, 0x2026, 0x2020, 0x2021,
+    0x02C6, 0x2030, 0x0160, 0x2039, 0x0152, 0x008D, 0x017D, 0x008F,
+    0x0090, 0x2018, 0x2019, 0x201C, 0x201D, 0x2022, 0x2013, 0x2014,
+    0x02DC, 0x2122, 0x0161, 0x203A, 0x0153, 0x009D, 0x017E, 0x0178,
+};
+MINIUTF_DATA_TABLE_END(, char16_t, cp1252_high)
+
+// How many bytes of str are not ASCII?
+MINIUTF_LOCAL
+size_t count_high_bytes(const std::string & str) {
+    const char * data = str.data();
+    size_t i = 0, count = 0;
+    for (; str.size() - i >= 8; i += 8) {
+        uint64_t word;
+        std::memcpy(&word, data + i, sizeof(word));
+        // Gather the high bits into the low bit of each byte, and add up the bytes.
+        count += (((word >> 7) & 0x0101010101010101ULL) * 0x0101010101010101ULL) >> 56;
+    }
+    for (; i < str.size(); i++)
+        count += static_cast<unsigned char>(data[i]) >> 7;
+    return count;
+}
+
+/*
+ * Convert single-byte text to UTF-8, with bytes 0x80 to 0x9F mapped through cp1252_high if
+ * cp1252 is set.
+ */
+MINIUTF_LOCAL
+std::string single_byte_to_utf8(const std::string & str, bool cp1252) {
+    // A byte becomes at most two bytes of UTF-8, or three for Windows-1252's 0x80 to 0x9F, so
+    // size the output for that and trim it afterwards.
+    std::string out;
+    {
+        MINIUTF_STAT_GROWTH(out);
+        out.resize(str.size() + count_high_bytes(str) * (cp1252 ? 2 : 1));
+    }
+    char * p = &out[0];
+
+    const char * data = str.data();
+    for (size_t i = 0; i < str.size(); ) {
+        if (str.size() - i >= 8 && is_ascii_word(data + i)) {
+            std::memcpy(p, data + i, 8);
+            p += 8;
+            i += 8;
+            continue;
+        }
+
+        const unsigned char b = data[i++];
+        if (b < 0x80)
+            *p++ = b;
+        else if (cp1252 && b < 0xA0)
+            p += utf8_encode(cp1252_high[b - 0x80], p);
+        else
+            p += utf8_encode(b, p);
+    }
+
+    out.resize(p - out.data());
+    return out;
+}
+
+MINIUTF_INLINE
+std::string latin1_to_utf8(const std::string & str) {
+    return single_byte_to_utf8(str, false);
+}
+
+MINIUTF_INLINE
+std::string cp1252_to_utf8(const std::string & str) {
+    return single_byte_to_utf8(str, true);
+}
+
+MINIUTF_INLINE
+std::string utf8_to_latin1(const std::string & str, bool * replacement_flag) {
+    // Never longer than the input.
+    std::string out;
+    {
+        MINIUTF_STAT_GROWTH(out);
+        out.resize(str.size());
+    }
+    char * p = &out[0];
+
+    const char * data = str.data();
+    for (size_t i = 0; i < str.size(); ) {
+        if (str.size() - i >= 8 && is_ascii_word(data + i)) {
+            std::memcpy(p, data + i, 8);
+            p += 8;
+            i += 8;
+            continue;
+        }
+
+        const char32_t pt = utf8_decode(str, i, replacement_flag);
+        if (pt < 0x100) {
+            *p++ = static_cast<char>(pt);
+        } else {
+            *p++ = '?';
+            if (replacement_flag)
+                *replacement_flag = true;
+        }
+    }
+
+    out.resize(p - out.data());
+    return out;
+}
+
+MINIUTF_INLINE
+bool fits_latin1(const std::string & str) {
+    MINIUTF_STAT(bytes_decoded, str.size());
+    const unsigned char * data = reinterpret_cast<const unsigned char *>(str.data());
+    for (size_t i = 0; i < str.size(); ) {
+        if (str.size() - i >= 8 && is_ascii_word(str.data() + i)) {
+            i += 8;
+        } else if (data[i] < 0x80) {
+            i++;
+        } else if ((data[i] == 0xC2 || data[i] == 0xC3) && (data[i + 1] & 0xC0) == 0x80) {
+            // U+0080 to U+00FF. (str is NUL-terminated, so data[i + 1] is readable.)
+            i += 2;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* * * * * * * * * *
+ * WTF-8 and CESU-8
+ * * * * * * * * * */
+
+MINIUTF_INLINE
+std::string utf16_to_wtf8(const std::u16string & str) {
+    // At most three bytes per code unit.
+    std::string out;
+    {
+        MINIUTF_STAT_GROWTH(out);
+        out.resize(str.size() * 3);
+    }
+    char * p = &out[0];
+
+    for (size_t i = 0; i < str.size(); ) {
+        if (str[i] < 0x80) {
+            *p++ = static_cast<char>(str[i++]);
+            continue;
+        }
+
+        // A pair decodes as usual; anything else is one unit, and encodes to itself.
+        const offset_pt res = utf16_decode_check(str, i);
+        if (res.offset < 0) {
+            p += utf8_encode(str[i], p);
+            i += 1;
+        } else {
+            p += utf8_encode(res.pt, p);
+            i += res.offset;
+        }
+    }
+
+    out.resize(p - out.data());
+    return out;
+}
+
+MINIUTF_INLINE
+std::u16string wtf8_to_utf16(const std::string & str, bool * replacement_flag) {
+    return to_utf16(str, replacement_flag);
+}
+
+// Is there a zero byte in the 8-byte word at p?
+MINIUTF_LOCAL bool has_zero_byte(const char * p) {
+    uint64_t word;
+    std::memcpy(&word, p, sizeof(word));
+    return ((word - 0x0101010101010101ULL) & ~word & 0x8080808080808080ULL) != 0;
+}
+
+/*
+ * Convert CESU-8 to UTF-8, decoding C0 80 as U+0000 if modified is set.
+ */
+MINIUTF_LOCAL
+std::string cesu8_to_utf8(const std::string & str, bool modified, bool * replacement_flag) {
     std::string out;
-    out.reserve(str.length() * 3 / 2); // estimate
-    for (char32_t pt : str)
+    counted_reserve(out, str.size()); // usually exact or an overestimate
+
+    const char * data = str.data();
+    for (size_t i = 0; i < str.size(); ) {
+        if (str.size() - i >= 8 && is_ascii_word(data + i)) {
+            MINIUTF_STAT_GROWTH(out);
+            out.append(data + i, 8);
+            i += 8;
+            continue;
+        }
+
+        if (modified && data[i] == '\xC0' && data[i + 1] == '\x80') {
+            MINIUTF_STAT_GROWTH(out);
+            out += '\0';
+            i += 2;
+            continue;
+        }
+
+        char32_t pt = utf8_decode(str, i, replacement_flag);
+        if (pt >= 0xD800 && pt < 0xDC00) {
+            const offset_pt low = utf8_decode_check(str, i);
+            if (low.offset > 0 && low.pt >= 0xDC00 && low.pt < 0xE000) {
+                MINIUTF_STAT(bytes_decoded, low.offset);
+                pt = (((pt - 0xD800) << 10) | (low.pt - 0xDC00)) + 0x10000;
+                i += low.offset;
+            }
+        }
+        if (pt >= 0xD800 && pt < 0xE000) {
+            pt = 0xFFFD;
+            if (replacement_flag)
+                *replacement_flag = true;
+        }
         utf8_encode(pt, out);
+    }
     return out;
 }
 
+/*
+ * Convert UTF-8 to CESU-8, encoding U+0000 as C0 80 if modified is set.
+ */
+MINIUTF_LOCAL
+std::string utf8_to_cesu8(const std::string & str, bool modified, bool * replacement_flag) {
+    // A 4-byte sequence becomes two 3-byte ones, and an invalid byte becomes a 3-byte U+FFFD,
+    // so allow three bytes per input byte.
+    std::string out;
+    {
+        MINIUTF_STAT_GROWTH(out);
+        out.resize(str.size() * 3);
+    }
+    char * p = &out[0];
+
+    const char * data = str.data();
+    for (size_t i = 0; i < str.size(); ) {
+        if (str.size() - i >= 8 && is_ascii_word(data + i)
+                && !(modified && has_zero_byte(data + i))) {
+            std::memcpy(p, data + i, 8);
+            p += 8;
+            i += 8;
+            continue;
+        }
+
+        const char32_t pt = utf8_decode(str, i, replacement_flag);
+        if (pt == 0 && modified) {
+            *p++ = '\xC0';
+            *p++ = '\x80';
+        } else {
+            char16_t units[2];
+            const int n = utf16_encode(pt, units);
+            for (int k = 0; k < n; k++)
+                p += utf8_encode(units[k], p);
+        }
+    }
+
+    out.resize(p - out.data());
+    return out;
+}
+
+MINIUTF_INLINE
+std::string cesu8_to_utf8(const std::string & str, bool * replacement_flag) {
+    return cesu8_to_utf8(str, false, replacement_flag);
+}
+
+MINIUTF_INLINE
+std::string utf8_to_cesu8(const std::string & str, bool * replacement_flag) {
+    return utf8_to_cesu8(str, false, replacement_flag);
+}
+
+MINIUTF_INLINE
+std::string mutf8_to_utf8(const std::string & str, bool * replacement_flag) {
+    return cesu8_to_utf8(str, true, replacement_flag);
+}
+
+MINIUTF_INLINE
+std::string utf8_to_mutf8(const std::string & str, bool * replacement_flag) {
+    return utf8_to_cesu8(str, true, replacement_flag);
+}
+
 /* * * * * * * * * *
  * Lowercase
  * * * * * * * * * */
 
+MINIUTF_INLINE
 std::string lowercase(const std::string & str) {
     std::string out;
-    out.reserve(str.size());
+    counted_reserve(out, str.size());
     for (size_t i = 0; i < str.length(); ) {
-        int32_t pt = utf8_decode(str, i);
-        utf8_encode(pt + lowercase_offset(pt), out);
+        utf8_encode(lowercase(utf8_decode(str, i)), out);
     }
     return out;
 }
 
+MINIUTF_INLINE
+char32_t lowercase(char32_t pt) {
+    return pt < 0x110000 ? pt + lowercase_offset(pt) : pt;
+}
+
 /* * * * * * * * * *
  * Composition
  * * * * * * * * * */
@@ -272,7 +1102,10 @@ std::string lowercase(const std::string & str) {
 /*
  * Write the canonical decomposition of pt to out.
  */
-static void unicode_decompose(char32_t pt, std::u32string & out) {
+MINIUTF_LOCAL
+void unicode_decompose(char32_t pt, std::u32string & out) {
+    MINIUTF_STAT_GROWTH(out);
+
     // Special-case: Hangul decomposition
     if (pt >= 0xAC00 && pt < 0xD7A4) {
         out += 0x1100 + (pt - 0xAC00) / 588;
@@ -300,7 +1133,8 @@ static void unicode_decompose(char32_t pt, std::u32string & out) {
 /*
  * If there is a Primary Composite equivalent to <L, C>, return it. Otherwise return 0.
  */
-static uint32_t unicode_compose(uint32_t L, uint32_t C) {
+MINIUTF_LOCAL
+uint32_t unicode_compose(uint32_t L, uint32_t C) {
     int comp_seq_idx;
 
     /* Algorithmic Hangul composition */
@@ -310,8 +1144,12 @@ static uint32_t unicode_compose(uint32_t L, uint32_t C) {
     if (L >= 0xAC00 && L < 0xD7A4 && !((L-0xAC00)%28) && C >= 0x11A8 && C < 0x11C3)
         return L + C - 0x11A7;
 
-    /* Predefined composition mapping */
+    /* Predefined composition mapping. Nothing below U+0300 is the second half of one. */
+    if (C < 0x300)
+        return 0;
     comp_seq_idx = comp_idx(L);
+    if (!comp_seq_idx)
+        return 0;
     do {
         if (xref[comp_seq[comp_seq_idx*2] & ~0x8000] == C)
             return xref[comp_seq[comp_seq_idx*2 + 1]];
@@ -320,19 +1158,54 @@ static uint32_t unicode_compose(uint32_t L, uint32_t C) {
     return 0;
 }
 
-std::u32string normalize32(const std::string & str, bool compose, bool * replacement_flag) {
-    if (str.empty())
-        return {};
+// HFS+ leaves codepoints in these ranges undecomposed (Apple Technical Note TN1150).
+MINIUTF_LOCAL bool hfs_excluded(char32_t pt) {
+    return (pt >= 0x2000 && pt < 0x3000) || (pt >= 0xF900 && pt < 0xFB00)
+        || (pt >= 0x2F800 && pt < 0x2FB00);
+}
+
+/*
+ * Normalize str[begin, end) into the given buffer, reusing its storage. end must be at the end
+ * of str or at an ASCII character, so that decoding stops there. With hfs set, codepoints in
+ * HFS+'s excluded ranges aren't decomposed.
+ */
+MINIUTF_LOCAL
+void normalize_span(const std::string & str, size_t begin, size_t end, bool compose, bool hfs,
+                    bool * replacement_flag, std::u32string & codepoints,
+                    std::vector<std::string::size_type> * offsets) {
+    codepoints.clear();
+    if (offsets)
+        offsets->clear();
+
+    if (begin == end)
+        return;
 
     // Decode and decompose
-    std::u32string codepoints;
-    codepoints.reserve(str.size());
-    for (size_t i = 0; i < str.length(); ) {
+    counted_reserve(codepoints, end - begin);
+    for (size_t i = begin; i < end; ) {
+        size_t start = i;
         uint32_t pt = utf8_decode(str, i, replacement_flag);
-        unicode_decompose(pt, codepoints);
+        if (hfs && hfs_excluded(pt)) {
+            MINIUTF_STAT_GROWTH(codepoints);
+            codepoints += pt;
+        } else {
+            unicode_decompose(pt, codepoints);
+        }
+        if (offsets) {
+            MINIUTF_STAT_GROWTH(*offsets);
+            offsets->resize(codepoints.size(), start);
+        }
     }
 
+    // Scratch space for reordering offsets along with codepoints in long runs; only used if
+    // offsets were requested.
+    std::vector<size_t> perm;
+    std::u32string run;
+    std::vector<std::string::size_type> run_offsets;
+
     // Canonical Ordering Algorithm: sort all runs of characters with nonzero combining class.
+    // Runs are nearly always a mark or two, so short ones are sorted in place.
+    const size_t short_run = 32;
     size_t start = 0;
     while (start < codepoints.length()) {
         if (!ccc(codepoints[start])) {
@@ -345,9 +1218,46 @@ std::u32string normalize32(const std::string & str, bool compose, bool * replace
             end++;
         }
 
-        if (end - start > 1) {
+        if (end - start > 1)
+            MINIUTF_STAT(segments_normalized, 1);
+
+        if (end - start > short_run && offsets) {
+            counted_reserve(perm, end - start);
+            counted_reserve(run, end - start);
+            counted_reserve(run_offsets, end - start);
+            perm.resize(end - start);
+            for (size_t j = 0; j < perm.size(); j++)
+                perm[j] = start + j;
+            std::stable_sort(perm.begin(), perm.end(), [&] (size_t a, size_t b) {
+                return ccc(codepoints[a]) < ccc(codepoints[b]);
+            });
+            run.clear();
+            run_offsets.clear();
+            for (size_t j : perm) {
+                run += codepoints[j];
+                run_offsets.push_back((*offsets)[j]);
+            }
+            std::copy(run.begin(), run.end(), codepoints.begin() + start);
+            std::copy(run_offsets.begin(), run_offsets.end(), offsets->begin() + start);
+        } else if (end - start > short_run) {
             std::stable_sort(codepoints.begin() + start, codepoints.begin() + end,
                              [] (char32_t a, char32_t b) { return ccc(a) < ccc(b); });
+        } else {
+            // An insertion sort is stable too, and needs no buffer.
+            for (size_t j = start + 1; j < end; j++) {
+                const char32_t ch = codepoints[j];
+                const int32_t ch_class = ccc(ch);
+                size_t k = j;
+                for (; k > start && ccc(codepoints[k - 1]) > ch_class; k--)
+                    codepoints[k] = codepoints[k - 1];
+                codepoints[k] = ch;
+                if (offsets && k != j) {
+                    const std::string::size_type offset = (*offsets)[j];
+                    std::copy_backward(offsets->begin() + k, offsets->begin() + j,
+                                       offsets->begin() + j + 1);
+                    (*offsets)[k] = offset;
+                }
+            }
         }
 
         start = end + 1;
@@ -371,10 +1281,14 @@ std::u32string normalize32(const std::string & str, bool compose, bool * replace
                 starter = ch;
                 last_class = -1;
                 codepoints[target_pos] = ch;
+                if (offsets)
+                    (*offsets)[target_pos] = (*offsets)[i];
                 target_pos++;
             } else {
                 last_class = ch_class;
                 codepoints[target_pos] = ch;
+                if (offsets)
+                    (*offsets)[target_pos] = (*offsets)[i];
                 target_pos++;
             }
 
@@ -382,22 +1296,615 @@ std::u32string normalize32(const std::string & str, bool compose, bool * replace
         }
 
         codepoints.resize(target_pos);
+        if (offsets)
+            offsets->resize(target_pos);
     }
+}
+
+/*
+ * normalize32, but into the given buffer, reusing its storage.
+ */
+MINIUTF_LOCAL
+void normalize_into(const std::string & str, bool compose, bool * replacement_flag,
+                    std::u32string & codepoints,
+                    std::vector<std::string::size_type> * offsets) {
+    normalize_span(str, 0, str.size(), compose, false, replacement_flag, codepoints, offsets);
+}
 
+MINIUTF_INLINE
+std::u32string normalize32(const std::string & str, bool compose, bool * replacement_flag,
+                           std::vector<std::string::size_type> * offsets) {
+    std::u32string codepoints;
+    normalize_into(str, compose, replacement_flag, codepoints, offsets);
     return codepoints;
 }
 
+MINIUTF_INLINE
+void normalize32(const std::string & str, bool compose, std::u32string & out,
+                 bool * replacement_flag, std::vector<std::string::size_type> * offsets) {
+    normalize_into(str, compose, replacement_flag, out, offsets);
+}
+
+MINIUTF_INLINE
 std::string normalize8(const std::string & str, bool compose, bool * replacement_flag) {
     std::u32string codepoints = normalize32(str, compose, replacement_flag);
     return to_utf8(codepoints);
 }
 
+MINIUTF_INLINE
 std::string nfc(const std::string & str, bool * replacement_flag) {
     return normalize8(str, true, replacement_flag);
 }
 
+MINIUTF_INLINE
 std::string nfd(const std::string & str, bool * replacement_flag) {
     return normalize8(str, false, replacement_flag);
 }
 
+/* * * * * * * * * *
+ * Contexts
+ * * * * * * * * * */
+
+/*
+ * Normalize str in codepoints and encode the result into out, reusing both buffers.
+ */
+MINIUTF_LOCAL
+void normalize_reusing(const std::string & str, bool compose, bool * replacement_flag,
+                       std::u32string & codepoints, std::string & out) {
+    normalize_into(str, compose, replacement_flag, codepoints, nullptr);
+    out.clear();
+    counted_reserve(out, str.size());
+    for (char32_t pt : codepoints)
+        utf8_encode(pt, out);
+}
+
+MINIUTF_INLINE
+const std::string & nfc(const std::string & str, context & ctx, bool * replacement_flag) {
+    normalize_reusing(ctx.unaliased(str), true, replacement_flag, ctx.m_codepoints,
+                      ctx.m_string);
+    return ctx.m_string;
+}
+
+MINIUTF_INLINE
+const std::string & nfd(const std::string & str, context & ctx, bool * replacement_flag) {
+    normalize_reusing(ctx.unaliased(str), false, replacement_flag, ctx.m_codepoints,
+                      ctx.m_string);
+    return ctx.m_string;
+}
+
+MINIUTF_INLINE
+const std::string & lowercase(const std::string & input, context & ctx) {
+    const std::string & str = ctx.unaliased(input);
+    std::string & out = ctx.m_string;
+    out.clear();
+    counted_reserve(out, str.size());
+    for (size_t i = 0; i < str.length(); )
+        utf8_encode(lowercase(utf8_decode(str, i)), out);
+    return out;
+}
+
+/* * * * * * * * * *
+ * Batch normalization
+ * * * * * * * * * */
+
+MINIUTF_LOCAL
+bool is_ascii(const char * data, size_t size) {
+    size_t i = 0;
+    for (; size - i >= 8; i += 8) {
+        if (!is_ascii_word(data + i))
+            return false;
+    }
+    for (; i < size; i++) {
+        if (static_cast<unsigned char>(data[i]) >= 0x80)
+            return false;
+    }
+    return true;
+}
+
+MINIUTF_LOCAL
+bool is_ascii(const std::string & str) {
+    return is_ascii(str.data(), str.size());
+}
+
+/*
+ * Normalize inputs[begin, end) and append them to out. out.offsets must already hold the
+ * offset at which the first one starts.
+ */
+MINIUTF_LOCAL
+void normalize_range(const std::vector<std::string> & inputs, size_t begin, size_t end,
+                     bool compose, normalized_batch & out, bool * replacement_flag) {
+    std::u32string scratch;
+    for (size_t i = begin; i < end; i++) {
+        const std::string & str = inputs[i];
+        if (is_ascii(str)) {
+            // ASCII is in every normalization form already.
+            MINIUTF_STAT_GROWTH(out.data);
+            MINIUTF_STAT(bytes_decoded, str.size());
+            out.data += str;
+        } else {
+            normalize_into(str, compose, replacement_flag, scratch, nullptr);
+            for (char32_t pt : scratch)
+                utf8_encode(pt, out.data);
+        }
+        out.offsets.push_back(out.data.size());
+    }
+}
+
+MINIUTF_INLINE
+void normalize_batch(const std::vector<std::string> & inputs, bool compose,
+                     normalized_batch & out, bool * replacement_flag, unsigned threads) {
+    size_t total_size = 0;
+    for (const std::string & str : inputs)
+        total_size += str.size();
+
+    out.data.clear();
+    out.offsets.clear();
+    counted_reserve(out.data, total_size);
+    counted_reserve(out.offsets, inputs.size() + 1);
+    out.offsets.push_back(0);
+
+    // Normalized text is usually about the same size as its input, so the reservations are
+    // rarely exceeded.
+    threads = std::max(1u, std::min<unsigned>(threads, inputs.size()));
+    if (threads == 1) {
+        normalize_range(inputs, 0, inputs.size(), compose, out, replacement_flag);
+        return;
+    }
+
+    // Split the inputs into one contiguous part per thread. This thread does the first part
+    // directly into out; the rest are appended to it afterwards.
+    struct part {
+        size_t begin, end;
+        normalized_batch batch;
+        bool replaced;
+        stats counters;
+        std::exception_ptr error;
+        std::thread thread;
+    };
+    std::vector<part> parts(threads - 1);
+    const size_t per_thread = (inputs.size() + threads - 1) / threads;
+
+    // Normalize a part, keeping any exception to be rethrown on this thread. A worker records
+    // its counters so that they can be added to this thread's.
+    auto run = [&inputs, compose] (part & p, bool worker) {
+        try {
+            size_t part_size = 0;
+            for (size_t i = p.begin; i < p.end; i++)
+                part_size += inputs[i].size();
+            counted_reserve(p.batch.data, part_size);
+            counted_reserve(p.batch.offsets, p.end - p.begin + 1);
+            p.batch.offsets.push_back(0);
+            normalize_range(inputs, p.begin, p.end, compose, p.batch, &p.replaced);
+        } catch (...) {
+            p.error = std::current_exception();
+        }
+        if (worker)
+            p.counters = stats_snapshot();
+    };
+
+    for (size_t k = 0; k < parts.size(); k++) {
+        part & p = parts[k];
+        p.begin = std::min((k + 1) * per_thread, inputs.size());
+        p.end = std::min(p.begin + per_thread, inputs.size());
+        p.replaced = false;
+
+        // If a thread can't be started, e.g. because the process has run out of them, its part
+        // is done on this thread below instead.
+        try {
+            p.thread = std::thread([&run, &p] { run(p, true); });
+        } catch (const std::system_error &) {
+        }
+    }
+
+    // Every started thread must be joined before parts goes away, even if this throws.
+    try {
+        normalize_range(inputs, 0, std::min(per_thread, inputs.size()), compose, out,
+                        replacement_flag);
+    } catch (...) {
+        for (part & p : parts) {
+            if (p.thread.joinable())
+                p.thread.join();
+        }
+        throw;
+    }
+
+    for (part & p : parts) {
+        if (p.thread.joinable())
+            p.thread.join();
+        else
+            run(p, false);
+    }
+    for (const part & p : parts) {
+        if (p.error)
+            std::rethrow_exception(p.error);
+    }
+
+    for (part & p : parts) {
+        const std::string::size_type base = out.data.size();
+        out.data += p.batch.data;
+        for (size_t i = 1; i < p.batch.offsets.size(); i++)
+            out.offsets.push_back(base + p.batch.offsets[i]);
+        if (p.replaced && replacement_flag)
+            *replacement_flag = true;
+
+        // Count the workers' work as this thread's.
+        MINIUTF_STAT(allocations, p.counters.allocations);
+        MINIUTF_STAT(bytes_decoded, p.counters.bytes_decoded);
+        MINIUTF_STAT(segments_normalized, p.counters.segments_normalized);
+    }
+}
+
+/* * * * * * * * * *
+ * Paths
+ * * * * * * * * * */
+
+/*
+ * Normalize path and append it to out. Nothing composes or reorders across a '/', so each
+ * component can be normalized separately, and those that are ASCII copied as they are.
+ */
+MINIUTF_LOCAL
+void normalize_path_into(const std::string & path, path_form form, bool * replacement_flag,
+                         std::u32string & scratch, std::string & out) {
+    if (is_ascii(path)) {
+        MINIUTF_STAT_GROWTH(out);
+        MINIUTF_STAT(bytes_decoded, path.size());
+        out += path;
+        return;
+    }
+
+    const bool compose = form == path_form::nfc, hfs = form == path_form::hfs;
+    for (size_t begin = 0; ; ) {
+        size_t end = path.find('/', begin);
+        if (end == std::string::npos)
+            end = path.size();
+
+        if (is_ascii(path.data() + begin, end - begin)) {
+            MINIUTF_STAT_GROWTH(out);
+            MINIUTF_STAT(bytes_decoded, end - begin);
+            out.append(path, begin, end - begin);
+        } else {
+            normalize_span(path, begin, end, compose, hfs, replacement_flag, scratch, nullptr);
+            for (char32_t pt : scratch)
+                utf8_encode(pt, out);
+        }
+
+        if (end == path.size())
+            break;
+        MINIUTF_STAT_GROWTH(out);
+        out += '/';
+        begin = end + 1;
+    }
+}
+
+MINIUTF_INLINE
+std::string normalize_path(const std::string & path, path_form form, bool * replacement_flag) {
+    std::string out;
+    counted_reserve(out, path.size());
+    std::u32string scratch;
+    normalize_path_into(path, form, replacement_flag, scratch, out);
+    return out;
+}
+
+MINIUTF_INLINE
+void normalize_paths(const std::vector<std::string> & paths, path_form form,
+                     normalized_batch & out, bool * replacement_flag) {
+    size_t total_size = 0;
+    for (const std::string & path : paths)
+        total_size += path.size();
+
+    out.data.clear();
+    out.offsets.clear();
+    counted_reserve(out.data, total_size);
+    counted_reserve(out.offsets, paths.size() + 1);
+    out.offsets.push_back(0);
+
+    std::u32string scratch;
+    for (const std::string & path : paths) {
+        normalize_path_into(path, form, replacement_flag, scratch, out.data);
+        out.offsets.push_back(out.data.size());
+    }
+}
+
+/* * * * * * * * * *
+ * Confusables
+ * * * * * * * * * */
+
+#ifdef MINIUTF_CONFUSABLES
+#ifndef MINIUTF_HAS_CONFUSABLE_DATA
+#error "MINIUTF_CONFUSABLES needs miniutfdata.h generated with data-6.3.0/confusables.txt"
+#endif
+
+MINIUTF_LOCAL
+bool is_confusable_ascii(char c) {
+    return (confusable_ascii[c >> 6] >> (c & 63)) & 1;
+}
+
+/*
+ * Append the prototype of pt to out, or pt itself if it isn't confusable. Return whether the
+ * prototype had anything outside ASCII in it.
+ */
+MINIUTF_LOCAL
+bool append_prototype(char32_t pt, std::string & out) {
+    const int32_t idx = confusable_idx(pt);
+    if (!idx) {
+        utf8_encode(pt, out);
+        return false;
+    }
+
+    bool ascii = true;
+    for (int32_t i = 0; i < (idx & 31); i++) {
+        const char32_t prototype_pt = confusable_seq[(idx >> 5) + i];
+        ascii = ascii && prototype_pt < 0x80;
+        utf8_encode(prototype_pt, out);
+    }
+    return !ascii;
+}
+
+MINIUTF_INLINE
+std::string skeleton(const std::string & str, bool * replacement_flag) {
+    // ASCII is NFD already, so ASCII with nothing confusable is its own skeleton.
+    size_t i = 0;
+    while (i < str.size() && static_cast<unsigned char>(str[i]) < 0x80
+           && !is_confusable_ascii(str[i])) {
+        i++;
+    }
+    if (i == str.size()) {
+        MINIUTF_STAT(bytes_decoded, str.size());
+        return str;
+    }
+
+    // Replacing codepoints with ASCII keeps a string in NFD, so the result only needs
+    // normalizing again if a prototype had something else in it, such as a combining mark.
+    bool renormalize = false;
+    std::string out;
+    counted_reserve(out, str.size());
+    if (is_ascii(str.data() + i, str.size() - i)) {
+        MINIUTF_STAT(bytes_decoded, str.size());
+        out.append(str, 0, i);
+        for (; i < str.size(); i++)
+            renormalize |= append_prototype(static_cast<unsigned char>(str[i]), out);
+    } else {
+        std::u32string decomposed;
+        normalize_into(str, false, replacement_flag, decomposed, nullptr);
+        for (char32_t pt : decomposed)
+            renormalize |= append_prototype(pt, out);
+    }
+    return renormalize ? nfd(out) : out;
+}
+#endif
+
+/* * * * * * * * * *
+ * Grapheme clusters
+ * * * * * * * * * */
+
+// Values of grapheme_break(), in the order of GRAPHEME_BREAK_PROPERTIES in preprocess.py.
+enum grapheme_break_property {
+    GB_OTHER, GB_CR, GB_LF, GB_CONTROL, GB_EXTEND, GB_REGIONAL_INDICATOR, GB_PREPEND,
+    GB_SPACING_MARK, GB_L, GB_V, GB_T, GB_LV, GB_LVT,
+};
+
+/*
+ * Is there a grapheme cluster boundary between codepoints with properties a and b? In
+ * Unicode 6.3 this only depends on the two codepoints on either side, so the rules are all
+ * here. (The comments refer to the rule numbers in UAX #29.)
+ */
+MINIUTF_LOCAL
+bool is_grapheme_break(int a, int b) {
+    // GB3, GB4, GB5: never break CR LF; always break around other controls.
+    if (a == GB_CR && b == GB_LF)
+        return false;
+    if (a == GB_CR || a == GB_LF || a == GB_CONTROL || b == GB_CR || b == GB_LF || b == GB_CONTROL)
+        return true;
+
+    // GB6, GB7, GB8: don't break Hangul syllable sequences.
+    if (a == GB_L && (b == GB_L || b == GB_V || b == GB_LV || b == GB_LVT))
+        return false;
+    if ((a == GB_LV || a == GB_V) && (b == GB_V || b == GB_T))
+        return false;
+    if ((a == GB_LVT || a == GB_T) && b == GB_T)
+        return false;
+
+    // GB8a: don't break between regional indicators.
+    if (a == GB_REGIONAL_INDICATOR && b == GB_REGIONAL_INDICATOR)
+        return false;
+
+    // GB9, GB9a, GB9b: don't break before extending characters or spacing marks, or after
+    // prepended characters.
+    if (b == GB_EXTEND || b == GB_SPACING_MARK || a == GB_PREPEND)
+        return false;
+
+    // GB10: otherwise, break everywhere.
+    return true;
+}
+
+/*
+ * Return the start of the codepoint that contains str[i]. An invalid byte counts as a
+ * codepoint by itself, just as when decoding forwards.
+ */
+MINIUTF_LOCAL
+std::string::size_type utf8_codepoint_start(const std::string & str, std::string::size_type i) {
+    std::string::size_type start = i;
+    while (start > 0 && i - start < 3 && (static_cast<unsigned char>(str[start]) & 0xC0) == 0x80)
+        start--;
+
+    const offset_pt res = utf8_decode_check(str, start);
+    if (res.offset > 0 && start + res.offset > i)
+        return start;
+    return i;
+}
+
+// The grapheme break property of the codepoint at str[i], or of U+FFFD if it's invalid.
+MINIUTF_LOCAL
+int grapheme_break_at(const std::string & str, std::string::size_type i, int & length) {
+    const offset_pt res = utf8_decode_check(str, i);
+    length = res.offset < 0 ? 1 : res.offset;
+    return res.offset < 0 ? GB_OTHER : grapheme_break(res.pt);
+}
+
+MINIUTF_INLINE
+std::string::size_type grapheme_next(const std::string & str, std::string::size_type pos) {
+    const std::string::size_type size = str.size();
+    if (pos >= size)
+        return size;
+
+    // Fast path: there's a boundary between any two ASCII characters except CR LF. (This
+    // relies on str[size] being 0.)
+    const unsigned char first = str[pos], second = str[pos + 1];
+    if (first < 0x80 && second < 0x80)
+        return (first == '\r' && second == '\n') ? pos + 2 : pos + 1;
+
+    int length;
+    int prop = grapheme_break_at(str, pos, length);
+    for (pos += length; pos < size; pos += length) {
+        // Everything breaks before an ASCII character, except CR before LF (and in principle
+        // after Prepend, though Unicode 6.3 has no such characters).
+        if (static_cast<unsigned char>(str[pos]) < 0x80 && prop != GB_CR && prop != GB_PREPEND)
+            return pos;
+
+        const int next_prop = grapheme_break_at(str, pos, length);
+        if (is_grapheme_break(prop, next_prop))
+            return pos;
+        prop = next_prop;
+    }
+    return size;
+}
+
+MINIUTF_INLINE
+std::string::size_type grapheme_prev(const std::string & str, std::string::size_type pos) {
+    pos = std::min(pos, str.size());
+    if (pos == 0)
+        return 0;
+
+    // Fast path, as in grapheme_next.
+    const unsigned char last = str[pos - 1];
+    if (last < 0x80 && (pos == 1 || static_cast<unsigned char>(str[pos - 2]) < 0x80))
+        return (pos >= 2 && str[pos - 2] == '\r' && last == '\n') ? pos - 2 : pos - 1;
+
+    std::string::size_type start = utf8_codepoint_start(str, pos - 1);
+    int length;
+    int prop = grapheme_break_at(str, start, length);
+    while (start > 0) {
+        const std::string::size_type prev_start = utf8_codepoint_start(str, start - 1);
+        const int prev_prop = grapheme_break_at(str, prev_start, length);
+        if (is_grapheme_break(prev_prop, prop))
+            return start;
+        start = prev_start;
+        prop = prev_prop;
+    }
+    return 0;
+}
+
+/* * * * * * * * * *
+ * Truncation
+ * * * * * * * * * */
+
+/*
+ * Is pt a starter that doesn't interact with anything before it under NFC, so that a string
+ * can be split just before it without changing its normalized form?
+ */
+MINIUTF_LOCAL
+bool is_nfc_stable_start(char32_t pt) {
+    if (ccc(pt) != 0)
+        return false;
+
+    // Hangul vowels and trailing consonants compose with the jamo or syllable before them.
+    if ((pt >= 0x1161 && pt < 0x1176) || (pt >= 0x11A8 && pt < 0x11C3))
+        return false;
+
+    return !std::binary_search(std::begin(unstable_starters), std::end(unstable_starters), pt);
+}
+
+MINIUTF_INLINE
+std::string::size_type truncate_utf8(const std::string & str, std::string::size_type max_bytes,
+                                     truncate_mode mode) {
+    if (max_bytes >= str.size())
+        return str.size();
+
+    // Cut before the codepoint that str[max_bytes] belongs to.
+    std::string::size_type end = utf8_codepoint_start(str, max_bytes);
+
+    if (mode == truncate_mode::grapheme && end > 0) {
+        int length;
+        const int prop = grapheme_break_at(str, end, length);
+        const int prev_prop = grapheme_break_at(str, utf8_codepoint_start(str, end - 1), length);
+        if (!is_grapheme_break(prev_prop, prop))
+            end = grapheme_prev(str, end);
+    } else if (mode == truncate_mode::nfc_stable) {
+        while (end > 0) {
+            const offset_pt res = utf8_decode_check(str, end);
+            if (res.offset < 0 || is_nfc_stable_start(res.pt))
+                break;
+            end = utf8_codepoint_start(str, end - 1);
+        }
+    }
+
+    return end;
+}
+
+/* * * * * * * * * *
+ * Display width
+ * * * * * * * * * */
+
+/*
+ * Are the eight bytes at p all printable ASCII, from 0x20 to 0x7E?
+ */
+MINIUTF_LOCAL bool is_printable_ascii_word(const char * p) {
+    uint64_t word;
+    std::memcpy(&word, p, sizeof(word));
+    const uint64_t below_space = (word - 0x2020202020202020ULL) & ~word;
+    const uint64_t above_tilde = (word + 0x0101010101010101ULL) | word;
+    return !((below_space | above_tilde) & 0x8080808080808080ULL);
+}
+
+MINIUTF_INLINE
+int codepoint_width(char32_t pt) {
+    // The table stores widths XORed with 1, so that the common width of 1 is 0.
+    return pt > 0x10FFFF ? 1 : char_width(pt) ^ 1;
+}
+
+MINIUTF_INLINE
+size_t display_width(const std::string & str) {
+    size_t width = 0;
+    for (size_t i = 0; i < str.size(); ) {
+        if (str.size() - i >= 8 && is_printable_ascii_word(str.data() + i)) {
+            width += 8;
+            i += 8;
+            continue;
+        }
+        const unsigned char c = str[i];
+        if (c >= 0x20 && c < 0x7F) {
+            width++;
+            i++;
+            continue;
+        }
+        width += codepoint_width(utf8_decode(str, i));
+    }
+    return width;
+}
+
+MINIUTF_INLINE
+std::string::size_type truncate_width(const std::string & str, size_t max_columns,
+                                      size_t * width_out) {
+    size_t width = 0;
+    size_t i = 0;
+    while (i < str.size()) {
+        if (str.size() - i >= 8 && max_columns - width >= 8
+            && is_printable_ascii_word(str.data() + i)) {
+            width += 8;
+            i += 8;
+            continue;
+        }
+        size_t next = i;
+        const size_t pt_width = codepoint_width(utf8_decode(str, next));
+        if (pt_width > max_columns - width)
+            break;
+        width += pt_width;
+        i = next;
+    }
+
+    if (width_out)
+        *width_out = width;
+    return i;
+}
+
 } // namespace miniutf
@@ -21,7 +21,34 @@
 
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
 #include <string>
+#include <vector>
+
+#if __cplusplus >= 201703L && defined(__has_include)
+#if __has_include(<memory_resource>)
+#include <memory_resource>
+#define MINIUTF_HAS_PMR
+#endif
+#endif
+
+/*
+ * Define MINIUTF_HEADER_ONLY to use miniutf without building miniutf.cpp and
+ * miniutf_collation.cpp: their definitions are then included by the corresponding headers, as
+ * inline functions, so the Unicode data lookups can be inlined into the loops that use them.
+ *
+ * MINIUTF_INLINE and MINIUTF_LOCAL give the linkage of miniutf's public functions and of its
+ * internal helpers, respectively.
+ */
+#ifdef MINIUTF_HEADER_ONLY
+#define MINIUTF_INLINE inline
+#define MINIUTF_LOCAL inline
+#else
+#define MINIUTF_INLINE
+#define MINIUTF_LOCAL static
+#endif
 
 namespace miniutf {
 
@@ -33,6 +60,14 @@ namespace miniutf {
 void utf8_encode(char32_t pt, std::string & out);
 void utf16_encode(char32_t pt, std::u16string & out);
 
+/*
+ * Character-at-a-time encoding into a buffer, which must have room for 4 bytes or 2 UTF-16
+ * code units. Convert pt as above, write it to out, and return the number of code units
+ * written.
+ */
+int utf8_encode(char32_t pt, char * out);
+int utf16_encode(char32_t pt, char16_t * out);
+
 /*
  * Character-at-a-time decoding. Decodes and returns the codepoint starting at str[pos],
  * and then advance pos by the appropriate amount.
@@ -47,6 +82,140 @@ char32_t utf16_decode(const std::u16string & str,
                       std::u16string::size_type & pos,
                       bool * replacement_flag = nullptr);
 
+/*
+ * The same, for a buffer [p, end) that needn't be a std::string or NUL-terminated: decode the
+ * codepoint at p, which must be before end, and advance p past it.
+ */
+char32_t utf8_decode(const char *& p, const char * end, bool * replacement_flag = nullptr);
+char32_t utf16_decode(const char16_t *& p,
+                      const char16_t * end,
+                      bool * replacement_flag = nullptr);
+
+/*
+ * Decoding backwards: step p back to the start of the codepoint that ends at p, which must be
+ * after begin and at a codepoint boundary, and return that codepoint. Stepping back from the
+ * end finds the same codepoints as decoding forwards from begin, including U+FFFD for each
+ * invalid byte or unpaired surrogate, which also sets *replacement_flag if it's non-null.
+ */
+char32_t utf8_decode_prev(const char *& p, const char * begin, bool * replacement_flag = nullptr);
+char32_t utf16_decode_prev(const char16_t *& p,
+                           const char16_t * begin,
+                           bool * replacement_flag = nullptr);
+
+/*
+ * Bidirectional iterators over the codepoints of a UTF-8 or UTF-16 buffer, decoding as above
+ * (so invalid sequences come out as U+FFFD), and a range of them for range-based for loops and
+ * std algorithms. Dereferencing returns the codepoint by value; base() gives the position in
+ * the buffer. ASCII is decoded inline, and anything else with one call to the functions above
+ * (which are inlined too with MINIUTF_HEADER_ONLY).
+ *
+ *   for (char32_t pt : miniutf::codepoints(str)) ...
+ *   std::find(r.begin(), r.end(), U'/').base()
+ *   std::reverse_iterator<miniutf::utf8_iterator>(r.end())
+ */
+template <typename CharT>
+class codepoint_iterator {
+public:
+    typedef std::bidirectional_iterator_tag iterator_category;
+    typedef char32_t value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef void pointer;
+    typedef char32_t reference;
+
+    codepoint_iterator() {}
+    codepoint_iterator(const CharT * pos, const CharT * begin, const CharT * end)
+        : m_pos(pos), m_next(pos), m_begin(begin), m_end(end) {
+        load();
+    }
+
+    char32_t operator*() const { return m_pt; }
+    const CharT * base() const { return m_pos; }
+
+    codepoint_iterator & operator++() {
+        m_pos = m_next;
+        load();
+        return *this;
+    }
+    codepoint_iterator & operator--() {
+        m_next = m_pos;
+        m_pt = decode_prev(m_pos, m_begin);
+        return *this;
+    }
+    codepoint_iterator operator++(int) { codepoint_iterator old = *this; ++*this; return old; }
+    codepoint_iterator operator--(int) { codepoint_iterator old = *this; --*this; return old; }
+
+    bool operator==(const codepoint_iterator & other) const { return m_pos == other.m_pos; }
+    bool operator!=(const codepoint_iterator & other) const { return m_pos != other.m_pos; }
+
+private:
+    // Decode the codepoint at m_pos, if there is one, and find where it ends.
+    void load() {
+        if (m_pos != m_end)
+            m_pt = decode(m_next, m_end);
+    }
+
+    // ASCII is handled here, where it can be inlined into the caller's loop.
+    static char32_t decode(const char *& p, const char * end) {
+        if (static_cast<unsigned char>(*p) < 0x80)
+            return *p++;
+        return utf8_decode(p, end);
+    }
+    static char32_t decode(const char16_t *& p, const char16_t * end) {
+        if (*p < 0x80)
+            return *p++;
+        return utf16_decode(p, end);
+    }
+    static char32_t decode_prev(const char *& p, const char * begin) {
+        if (static_cast<unsigned char>(p[-1]) < 0x80)
+            return *--p;
+        return utf8_decode_prev(p, begin);
+    }
+    static char32_t decode_prev(const char16_t *& p, const char16_t * begin) {
+        if (p[-1] < 0x80)
+            return *--p;
+        return utf16_decode_prev(p, begin);
+    }
+
+    const CharT * m_pos = nullptr;
+    const CharT * m_next = nullptr;
+    const CharT * m_begin = nullptr;
+    const CharT * m_end = nullptr;
+    char32_t m_pt = 0;
+};
+
+typedef codepoint_iterator<char> utf8_iterator;
+typedef codepoint_iterator<char16_t> utf16_iterator;
+
+template <typename CharT>
+class codepoint_range {
+public:
+    codepoint_range(const CharT * data, size_t size) : m_begin(data), m_end(data + size) {}
+
+    codepoint_iterator<CharT> begin() const {
+        return codepoint_iterator<CharT>(m_begin, m_begin, m_end);
+    }
+    codepoint_iterator<CharT> end() const {
+        return codepoint_iterator<CharT>(m_end, m_begin, m_end);
+    }
+
+private:
+    const CharT * m_begin;
+    const CharT * m_end;
+};
+
+inline codepoint_range<char> codepoints(const char * data, size_t size) {
+    return codepoint_range<char>(data, size);
+}
+inline codepoint_range<char> codepoints(const std::string & str) {
+    return codepoint_range<char>(str.data(), str.size());
+}
+inline codepoint_range<char16_t> codepoints(const char16_t * data, size_t size) {
+    return codepoint_range<char16_t>(data, size);
+}
+inline codepoint_range<char16_t> codepoints(const std::u16string & str) {
+    return codepoint_range<char16_t>(str.data(), str.size());
+}
+
 /*
  * Return true if str is valid UTF-8, -16, or -32.
  *
@@ -59,37 +228,140 @@ char32_t utf16_decode(const std::u16string & str,
  * - UTF-32 is valid if it contains no codepoints above U+10FFFF.
  */
 bool utf8_check(const std::string & str);
-bool utf16_check(const std::string & str);
-bool utf32_check(const std::string & str);
+bool utf16_check(const std::u16string & str);
+bool utf32_check(const std::u32string & str);
 
 /*
  * Convert back and forth between UTF-8 and UTF-16 or UTF-32.
  *
  * These functions replace invalid sections of input with U+FFFD. If this is not desired,
- * use utf8_check (above) first to check that the input is valid.
+ * use utf8_check (above) first to check that the input is valid. to_utf16 also sets
+ * *replacement_flag to true if it replaces anything and replacement_flag is non-null.
  */
 std::u32string to_utf32(const std::string & str);
-std::u16string to_utf16(const std::string & str);
+std::u16string to_utf16(const std::string & str, bool * replacement_flag = nullptr);
 std::string to_utf8(const std::u16string & str);
 std::string to_utf8(const std::u32string & str);
 
+/*
+ * Return the number of codepoints in str, or its length in UTF-16 code units: the same as
+ * to_utf32(str).size() and to_utf16(str).size(), including a U+FFFD for each invalid byte, but
+ * without converting. ASCII text is counted a word at a time.
+ */
+std::string::size_type count_codepoints(const std::string & str);
+std::string::size_type utf16_length(const std::string & str);
+
+/*
+ * UTF-16 as a stream of bytes in a given byte order, such as a UTF-16LE file, without first
+ * copying it into a native-endian std::u16string.
+ *
+ * utf16_detect_bom: if data starts with a byte order mark, set order to the byte order it
+ * indicates and return its length (2), so that the caller can skip it; otherwise return 0 and
+ * leave order alone, so that it keeps the caller's default.
+ *
+ * utf16_bytes_to_utf8: convert size bytes of UTF-16 at data to UTF-8. Unpaired surrogates,
+ * and a trailing odd byte, are replaced with U+FFFD, and if replacement_flag is non-null it's
+ * set to true. If error_offset is non-null, it's set to the byte offset of the first such
+ * error, or to std::string::npos if there is none. A byte order mark isn't skipped.
+ *
+ * utf8_to_utf16_bytes: convert str to UTF-16 bytes, as to_utf16 does, preceded by a byte
+ * order mark if bom is set.
+ *
+ * utf16_bytes_check: return true if the bytes are valid UTF-16 (see utf16_check). If not, and
+ * error_offset is non-null, set it to the byte offset of the first error.
+ *
+ * Runs of ASCII are converted several characters at a time.
+ */
+enum class byte_order { little_endian, big_endian };
+
+size_t utf16_detect_bom(const char * data, size_t size, byte_order & order);
+std::string utf16_bytes_to_utf8(const char * data,
+                                size_t size,
+                                byte_order order,
+                                bool * replacement_flag = nullptr,
+                                size_t * error_offset = nullptr);
+std::string utf8_to_utf16_bytes(const std::string & str, byte_order order, bool bom = false);
+bool utf16_bytes_check(const char * data,
+                       size_t size,
+                       byte_order order,
+                       size_t * error_offset = nullptr);
+
+/*
+ * Single-byte encodings.
+ *
+ * latin1_to_utf8 and cp1252_to_utf8 convert ISO-8859-1 and Windows-1252 text to UTF-8. Every
+ * byte is valid in both: the bytes that Windows-1252 leaves undefined (0x81, 0x8D, 0x8F, 0x90
+ * and 0x9D) become the C1 controls with the same values, as in the WHATWG Encoding Standard.
+ *
+ * utf8_to_latin1 converts str to ISO-8859-1. Codepoints above U+00FF, and invalid UTF-8, are
+ * replaced with '?', and if replacement_flag is non-null it's set to true.
+ *
+ * fits_latin1 returns true if str is valid UTF-8 with no codepoints above U+00FF, i.e. if
+ * utf8_to_latin1 would convert it without replacement.
+ *
+ * Runs of ASCII are copied a word at a time.
+ */
+std::string latin1_to_utf8(const std::string & str);
+std::string cp1252_to_utf8(const std::string & str);
+std::string utf8_to_latin1(const std::string & str, bool * replacement_flag = nullptr);
+bool fits_latin1(const std::string & str);
+
+/*
+ * WTF-8 and CESU-8.
+ *
+ * utf16_to_wtf8 converts UTF-16 that may contain unpaired surrogates, such as a Windows
+ * filename, to WTF-8: paired surrogates are encoded as in UTF-8, and unpaired ones as the
+ * 3-byte sequence for the surrogate codepoint, so nothing is lost. wtf8_to_utf16 converts back.
+ * It just calls to_utf16, which already decodes encoded surrogates to themselves.
+ *
+ * cesu8_to_utf8 and utf8_to_cesu8 convert from and to CESU-8, in which codepoints outside the
+ * BMP are encoded as two 3-byte sequences, one per UTF-16 surrogate. The mutf8 forms are for
+ * Java's Modified UTF-8, which is CESU-8 with U+0000 encoded as the two bytes C0 80 so that
+ * the output has no zero bytes.
+ *
+ * Invalid input, and unpaired surrogates in the CESU-8 or Modified UTF-8 input of the to-UTF-8
+ * forms, are replaced with U+FFFD, and if replacement_flag is non-null it's set to true.
+ */
+std::string utf16_to_wtf8(const std::u16string & str);
+std::u16string wtf8_to_utf16(const std::string & str, bool * replacement_flag = nullptr);
+std::string cesu8_to_utf8(const std::string & str, bool * replacement_flag = nullptr);
+std::string utf8_to_cesu8(const std::string & str, bool * replacement_flag = nullptr);
+std::string mutf8_to_utf8(const std::string & str, bool * replacement_flag = nullptr);
+std::string utf8_to_mutf8(const std::string & str, bool * replacement_flag = nullptr);
+
 /*
  * Convert str to lowercase, per the built-in Unicode lowercasing map (codepoint-by-codepoint).
+ * The second form converts a single codepoint.
  */
 std::string lowercase(const std::string & str);
+char32_t lowercase(char32_t pt);
 
 /*
  * Decompose str. Then, if compose is set, recompose it.
  *
  * If replacement characters are used during decoding (i.e. str contains invalid UTF-8), and
  * replacement_flag is specified, it will be set to true.
+ *
+ * If offsets is specified, normalize32 fills it with the byte offset in str of the input
+ * codepoint that each output codepoint came from. (A composed codepoint gets the offset of
+ * its starter.)
  */
 std::string normalize8(const std::string & str,
                        bool compose,
                        bool * replacement_flag = nullptr);
 std::u32string normalize32(const std::string & str,
                            bool compose,
-                           bool * replacement_flag = nullptr);
+                           bool * replacement_flag = nullptr,
+                           std::vector<std::string::size_type> * offsets = nullptr);
+
+/*
+ * normalize32, but into out (replacing its contents), so that its storage can be reused.
+ */
+void normalize32(const std::string & str,
+                 bool compose,
+                 std::u32string & out,
+                 bool * replacement_flag = nullptr,
+                 std::vector<std::string::size_type> * offsets = nullptr);
 
 /*
  * Convert str to Normalization Form C. Equivalent to normalize8(str, true, replacement_flag).
@@ -107,4 +379,337 @@ std::string nfc(const std::string & str, bool * replacement_flag = nullptr);
  */
 std::string nfd(const std::string & str, bool * replacement_flag = nullptr);
 
+/*
+ * Reusable buffers for hot loops.
+ *
+ * nfc, nfd, lowercase and match_key (in miniutf_collation.hpp) can work in a context's
+ * buffers instead of allocating their own, and return their result by reference to a buffer
+ * in the context, valid until the context is next used. A result can be passed straight back
+ * in with the same context, as in lowercase(nfc(str, ctx), ctx).
+ *
+ * Once the buffers have grown to fit, calling them in a loop with the same context allocates
+ * nothing, with one exception: a run of more than 32 combining marks in a row (which no real
+ * text has) is reordered with std::stable_sort and temporary buffers, which may allocate.
+ * A context must not be used by more than one thread at a time.
+ */
+class context {
+public:
+    context() {}
+
+private:
+    // Return str, or if str is m_string (the result of an earlier call), move it to m_input
+    // first so that the new result can be written without clobbering it.
+    const std::string & unaliased(const std::string & str) {
+        if (&str != &m_string)
+            return str;
+        m_input.swap(m_string);
+        return m_input;
+    }
+
+    std::u32string m_codepoints;
+    std::vector<std::string::size_type> m_offsets;
+    std::string m_string;
+    std::string m_input;
+    std::vector<uint32_t> m_key;
+
+    friend const std::string & nfc(const std::string &, context &, bool *);
+    friend const std::string & nfd(const std::string &, context &, bool *);
+    friend const std::string & lowercase(const std::string &, context &);
+    friend const std::vector<uint32_t> &
+    match_key(const std::string &, context &,
+              std::vector<std::pair<std::string::size_type, std::string::size_type>> *);
+};
+
+const std::string & nfc(const std::string & str,
+                        context & ctx,
+                        bool * replacement_flag = nullptr);
+const std::string & nfd(const std::string & str,
+                        context & ctx,
+                        bool * replacement_flag = nullptr);
+const std::string & lowercase(const std::string & str, context & ctx);
+
+/*
+ * Allocator-aware conversions. These work like the functions of the same names above, but
+ * append their result to out, which may be a std::basic_string with any allocator (such as a
+ * per-request arena, or a std::pmr string), rather than returning a new std::string.
+ *
+ * Besides out, the only memory they use is a scratch buffer for normalization that each thread
+ * keeps from call to call, so strings of up to normalize_scratch_limit codepoints need no
+ * allocation except from out's allocator. The buffer is freed after a longer string, so it
+ * never holds more than that for the life of the thread.
+ */
+template <typename Alloc>
+using basic_utf8_string = std::basic_string<char, std::char_traits<char>, Alloc>;
+template <typename Alloc>
+using basic_utf16_string = std::basic_string<char16_t, std::char_traits<char16_t>, Alloc>;
+template <typename Alloc>
+using basic_utf32_string = std::basic_string<char32_t, std::char_traits<char32_t>, Alloc>;
+
+template <typename Alloc>
+void to_utf32(const std::string & str, basic_utf32_string<Alloc> & out) {
+    out.reserve(out.size() + str.size()); // likely overallocate
+    for (std::string::size_type i = 0; i < str.size(); )
+        out += utf8_decode(str, i);
+}
+
+template <typename Alloc>
+void to_utf16(const std::string & str, basic_utf16_string<Alloc> & out) {
+    out.reserve(out.size() + str.size()); // likely overallocate
+    char16_t buf[2];
+    for (std::string::size_type i = 0; i < str.size(); )
+        out.append(buf, utf16_encode(utf8_decode(str, i), buf));
+}
+
+template <typename Alloc>
+void to_utf8(const std::u16string & str, basic_utf8_string<Alloc> & out) {
+    out.reserve(out.size() + str.size() * 3 / 2); // estimate
+    char buf[4];
+    for (std::u16string::size_type i = 0; i < str.size(); )
+        out.append(buf, utf8_encode(utf16_decode(str, i), buf));
+}
+
+template <typename Alloc>
+void to_utf8(const std::u32string & str, basic_utf8_string<Alloc> & out) {
+    out.reserve(out.size() + str.size() * 3 / 2); // estimate
+    char buf[4];
+    for (char32_t pt : str)
+        out.append(buf, utf8_encode(pt, buf));
+}
+
+template <typename Alloc>
+void lowercase(const std::string & str, basic_utf8_string<Alloc> & out) {
+    out.reserve(out.size() + str.size());
+    char buf[4];
+    for (std::string::size_type i = 0; i < str.size(); )
+        out.append(buf, utf8_encode(lowercase(utf8_decode(str, i)), buf));
+}
+
+const size_t normalize_scratch_limit = 1024;
+
+// The calling thread's scratch buffer for normalize8 below, shared by every allocator type.
+inline std::u32string & normalize_scratch() {
+    static thread_local std::u32string scratch;
+    return scratch;
+}
+
+template <typename Alloc>
+void normalize8(const std::string & str,
+                bool compose,
+                basic_utf8_string<Alloc> & out,
+                bool * replacement_flag = nullptr) {
+    std::u32string & scratch = normalize_scratch();
+    normalize32(str, compose, scratch, replacement_flag);
+    to_utf8(scratch, out);
+    if (scratch.capacity() > normalize_scratch_limit)
+        std::u32string().swap(scratch);
+}
+
+template <typename Alloc>
+void nfc(const std::string & str, basic_utf8_string<Alloc> & out,
+         bool * replacement_flag = nullptr) {
+    normalize8(str, true, out, replacement_flag);
+}
+
+template <typename Alloc>
+void nfd(const std::string & str, basic_utf8_string<Alloc> & out,
+         bool * replacement_flag = nullptr) {
+    normalize8(str, false, out, replacement_flag);
+}
+
+#ifdef MINIUTF_HAS_PMR
+/*
+ * In C++17, the same conversions returning std::pmr strings allocated from resource. These
+ * have their own names, since nfc(str, nullptr) would otherwise be ambiguous with the
+ * replacement_flag overloads.
+ */
+inline std::pmr::u32string to_utf32_pmr(const std::string & str,
+                                        std::pmr::memory_resource * resource) {
+    std::pmr::u32string out(resource);
+    to_utf32(str, out);
+    return out;
+}
+
+inline std::pmr::u16string to_utf16_pmr(const std::string & str,
+                                        std::pmr::memory_resource * resource) {
+    std::pmr::u16string out(resource);
+    to_utf16(str, out);
+    return out;
+}
+
+inline std::pmr::string to_utf8_pmr(const std::u16string & str,
+                                    std::pmr::memory_resource * resource) {
+    std::pmr::string out(resource);
+    to_utf8(str, out);
+    return out;
+}
+
+inline std::pmr::string to_utf8_pmr(const std::u32string & str,
+                                    std::pmr::memory_resource * resource) {
+    std::pmr::string out(resource);
+    to_utf8(str, out);
+    return out;
+}
+
+inline std::pmr::string lowercase_pmr(const std::string & str,
+                                      std::pmr::memory_resource * resource) {
+    std::pmr::string out(resource);
+    lowercase(str, out);
+    return out;
+}
+
+inline std::pmr::string nfc_pmr(const std::string & str, std::pmr::memory_resource * resource,
+                                bool * replacement_flag = nullptr) {
+    std::pmr::string out(resource);
+    nfc(str, out, replacement_flag);
+    return out;
+}
+
+inline std::pmr::string nfd_pmr(const std::string & str, std::pmr::memory_resource * resource,
+                                bool * replacement_flag = nullptr) {
+    std::pmr::string out(resource);
+    nfd(str, out, replacement_flag);
+    return out;
+}
+#endif
+
+/*
+ * Batch normalization, for normalizing many short strings (such as filenames) at once.
+ *
+ * normalize_batch normalizes each of inputs as normalize8(input, compose) would, and writes
+ * the results one after another into out.data: result i is the range [out.offsets[i],
+ * out.offsets[i+1]), so out.offsets has inputs.size() + 1 entries. out is cleared first but
+ * its storage is reused, and the work is done in one scratch buffer, so normalizing batch
+ * after batch into the same out needs almost no allocation. Inputs that are all ASCII are
+ * copied without decoding.
+ *
+ * If threads is more than 1, the inputs are split into that many contiguous parts, each
+ * normalized on its own thread (this one included) and then copied into out. The output is
+ * the same either way. A part whose thread can't be started is normalized on this thread.
+ */
+struct normalized_batch {
+    std::string data;
+    std::vector<std::string::size_type> offsets;
+};
+
+void normalize_batch(const std::vector<std::string> & inputs,
+                     bool compose,
+                     normalized_batch & out,
+                     bool * replacement_flag = nullptr,
+                     unsigned threads = 1);
+
+/*
+ * Path normalization, for filenames synced between systems that store them in different forms.
+ * normalize_path normalizes each '/'-separated component of path to the given form:
+ *
+ *  - nfc, nfd: as by nfc and nfd, with the same result as normalizing the whole path.
+ *  - hfs: the decomposition HFS+ stores, which is NFD except that U+2000 to U+2FFF, U+F900 to
+ *    U+FAFF and U+2F800 to U+2FAFF are left as they are (Apple Technical Note TN1150).
+ *
+ * Components that are ASCII are copied without being decoded. normalize_paths does the same
+ * for a list of paths, such as a directory listing, into one normalized_batch (see above).
+ */
+enum class path_form { nfc, nfd, hfs };
+
+std::string normalize_path(const std::string & path,
+                           path_form form,
+                           bool * replacement_flag = nullptr);
+void normalize_paths(const std::vector<std::string> & paths,
+                     path_form form,
+                     normalized_batch & out,
+                     bool * replacement_flag = nullptr);
+
+#ifdef MINIUTF_CONFUSABLES
+/*
+ * The skeleton of a string, as defined by UTS #39 for detecting confusable strings: the NFD form,
+ * with each codepoint that's confusable with others replaced by the prototype of its set (from
+ * confusables.txt), in NFD again. Two strings are visually confusable if their skeletons are
+ * the same, e.g. "pa\u0443pal" (with a Cyrillic u) and "paypal", or "\uFB01le" and "file".
+ *
+ * This is only built with MINIUTF_CONFUSABLES defined, which needs miniutfdata.h generated
+ * with data-6.3.0/confusables.txt present (fetch-security-data.sh downloads it); the
+ * checked-in miniutfdata.h doesn't have the tables.
+ *
+ * Skeletons are for comparison only. They aren't meant to be displayed, and can change with
+ * the data. ASCII with nothing confusable in it is its own skeleton, and is just copied.
+ */
+std::string skeleton(const std::string & str, bool * replacement_flag = nullptr);
+#endif
+
+/*
+ * Extended grapheme clusters, as defined by UAX #29 for Unicode 6.3.
+ *
+ * grapheme_next returns the first grapheme cluster boundary after pos, or str.size() if there
+ * is none; grapheme_prev returns the last boundary before pos, or 0. pos should be at the
+ * start of a codepoint. Neither function allocates, so calling grapheme_next until it returns
+ * str.size() is a cheap way to visit each cluster in turn. Invalid UTF-8 is treated as by
+ * utf8_decode, i.e. as U+FFFD for each invalid byte.
+ */
+std::string::size_type grapheme_next(const std::string & str, std::string::size_type pos);
+std::string::size_type grapheme_prev(const std::string & str, std::string::size_type pos);
+
+/*
+ * Truncation to a byte limit. Return the length of the longest prefix of str that is at most
+ * max_bytes long and ends at a boundary of the given kind:
+ *
+ *  - codepoint: the prefix is valid UTF-8 if str is.
+ *  - grapheme: a grapheme cluster boundary, as found by grapheme_next.
+ *  - nfc_stable: a boundary that normalization doesn't cross, i.e. one such that
+ *    nfc(prefix) + nfc(rest) == nfc(str). The prefix is also a codepoint boundary.
+ *
+ * This only looks back from max_bytes as far as the start of a codepoint, cluster or combining
+ * sequence, not at the rest of str. Nothing is copied: use str.substr(0, n), or str.data()
+ * and n, to get the prefix.
+ */
+enum class truncate_mode { codepoint, grapheme, nfc_stable };
+
+std::string::size_type truncate_utf8(const std::string & str,
+                                     std::string::size_type max_bytes,
+                                     truncate_mode mode = truncate_mode::codepoint);
+
+/*
+ * Display width: the number of columns text takes up in a terminal, as by wcwidth. Wide and
+ * fullwidth East Asian characters take two columns. Combining marks, format characters other
+ * than the soft hyphen, controls, and Hangul medial vowels and final consonants take none.
+ * Everything else takes one, including East Asian ambiguous characters and invalid bytes, which
+ * count as U+FFFD.
+ *
+ * display_width is the sum of codepoint_width over str, taken eight bytes at a time over runs
+ * of printable ASCII. truncate_width returns the length of the longest prefix of str that is
+ * at most max_columns wide, and sets *width to its width if width is non-null. Unlike
+ * truncate_utf8 it reads str from the start. Zero-width codepoints just after the limit are
+ * kept with the prefix, so combining marks stay with their base.
+ */
+int codepoint_width(char32_t pt);
+size_t display_width(const std::string & str);
+std::string::size_type truncate_width(const std::string & str,
+                                      size_t max_columns,
+                                      size_t * width = nullptr);
+
+/*
+ * Per-thread instrumentation counters.
+ *
+ * These are only collected if miniutf is built with MINIUTF_STATS defined; otherwise the
+ * instrumentation compiles out and stats_snapshot() always returns zeros. The counters are
+ * cumulative for the calling thread until stats_reset() is called.
+ *
+ * allocations counts the times a buffer miniutf manages (an output string, a scratch vector)
+ * gets new storage, as seen by its capacity changing. Memory the standard library allocates
+ * internally, such as std::stable_sort's temporary buffer, isn't counted, since whether it
+ * allocates at all differs between implementations.
+ */
+struct stats {
+    uint64_t allocations;           // miniutf's own buffers created or grown (see below)
+    uint64_t bytes_decoded;         // UTF-8 bytes decoded or checked
+    uint64_t segments_normalized;   // Runs of combining marks canonically reordered
+    uint64_t ducet_probes;          // DUCET hash table lookups
+    uint64_t contraction_checks;    // Non-starters tested for discontiguous contractions
+};
+
+stats stats_snapshot();
+void stats_reset();
+
 } // namespace miniutf
+
+#ifdef MINIUTF_HEADER_ONLY
+#include "miniutf.cpp"
+#endif
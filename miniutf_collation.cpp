@@ -20,22 +20,241 @@
  */
 
 #include "miniutf_collation.hpp"
+#include "miniutf_stats.hpp"
 
+#include <algorithm>
+#include <bitset>
 #include <cassert>
-#include <unordered_set>
+#include <cstdlib>
+#include <cstring>
 #include <vector>
 
+#ifdef MINIUTF_EXTERNAL_COLLATION_DATA
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#include <fstream>
+#endif
+#endif
+
 namespace miniutf {
 
-#include "miniutfdata_collation.h"
+// The longest DUCET key that can be looked up; load_collation_data refuses longer ones.
+static const size_t max_key_length = 8;
 
 // The highest possible codepoint is 0x10FFFF, so we need 21 bits to represent a codepoint.
 #define UNICODE_CODE_SPACE_BITS 21
 
+#ifdef MINIUTF_EXTERNAL_COLLATION_DATA
+
+/* * * * * * * * * *
+ * Collation data loaded at runtime
+ * * * * * * * * * */
+
+// The blob layout is described in make_collation_blob in preprocess.py.
+static const uint32_t collation_blob_format = 1;
+static const uint32_t collation_blob_unicode_version = 0x060300;
+static const size_t collation_blob_header_words = 13;
+static const size_t collation_blob_header_size = 8 + collation_blob_header_words * 4;
+
+struct ducet_blob_tables {
+    const uint32_t * data;
+    const uint32_t * data_end;
+    const uint32_t * bucket_indexes;
+    uint32_t params[8];
+
+    // The whole payload and its expected checksum, for verify_collation_data.
+    const unsigned char * payload;
+    size_t payload_size;
+    uint32_t checksum;
+};
+
+// The loaded tables. This is a function rather than a variable so that header-only builds
+// have just one.
+MINIUTF_LOCAL
+ducet_blob_tables & ducet_blob() {
+    static ducet_blob_tables tables;
+    return tables;
+}
+
+#define DUCET_HASH_BUCKETS      (ducet_blob().params[0])
+#define DUCET_HASH_MULTIPLIER   (ducet_blob().params[1])
+#define DUCET_LONGEST_KEY       (ducet_blob().params[2])
+#define DUCET_KEY_BITS          (ducet_blob().params[3])
+#define DUCET_VALUE_BITS        (ducet_blob().params[4])
+#define DUCET_DATA_HIGH_BIT     (ducet_blob().params[5])
+#define DUCET_L1_SHIFT          (ducet_blob().params[6])
+#define DUCET_L2_SHIFT          (ducet_blob().params[7])
+
+MINIUTF_LOCAL bool ducet_loaded() { return ducet_blob().data != nullptr; }
+MINIUTF_LOCAL const uint32_t * ducet_data_begin() { return ducet_blob().data; }
+MINIUTF_LOCAL const uint32_t * ducet_data_end() { return ducet_blob().data_end; }
+MINIUTF_LOCAL uint32_t ducet_bucket_index(size_t hash) { return ducet_blob().bucket_indexes[hash]; }
+
+/* Same hash as fnv1a in preprocess.py.
+ */
+MINIUTF_LOCAL
+uint32_t fnv1a(const unsigned char * begin, const unsigned char * end) {
+    uint32_t hash = 0x811c9dc5;
+    while (begin != end)
+        hash = (hash ^ *begin++) * 0x01000193;
+    return hash;
+}
+
+/*
+ * Check that find_elements can't read outside a blob's table: the parameters it shifts by are
+ * in range, every record fits, and every bucket starts at a record. Unlike the checksum this
+ * reads every record's first word, so it touches the whole table, but only once.
+ */
+MINIUTF_LOCAL
+bool collation_records_valid(const uint32_t * data, uint32_t data_len,
+                             const uint32_t * bucket_indexes, uint32_t bucket_count,
+                             const uint32_t * params) {
+    const uint32_t key_bits = params[3], value_bits = params[4], high_bit = params[5];
+    if (high_bit > 31 || key_bits + value_bits + UNICODE_CODE_SPACE_BITS > high_bit
+        || params[6] > 31 || params[7] > params[6]) {
+        return false;
+    }
+
+    std::vector<bool> record_starts(uint64_t(data_len) + 1);
+    uint32_t i = 0;
+    while (i < data_len) {
+        record_starts[i] = true;
+        const uint32_t key_len = (data[i] >> (high_bit - key_bits)) & ~(~0ULL << key_bits);
+        const uint32_t value_len = (data[i] >> (high_bit - key_bits - value_bits))
+                                   & ~(~0ULL << value_bits);
+        if (key_len == 0 || key_len + value_len > data_len - i)
+            return false;
+        i += key_len + value_len;
+    }
+    record_starts[data_len] = true;
+
+    for (uint32_t b = 0; b < bucket_count; b++) {
+        if (bucket_indexes[b] > data_len || !record_starts[bucket_indexes[b]])
+            return false;
+    }
+    return true;
+}
+
+MINIUTF_INLINE
+bool load_collation_data(const void * blob, size_t size) {
+    // The blob is little-endian and used in place.
+    const uint32_t one = 1;
+    if (*reinterpret_cast<const unsigned char *>(&one) != 1)
+        return false;
+
+    if (reinterpret_cast<uintptr_t>(blob) % alignof(uint32_t) || size < collation_blob_header_size)
+        return false;
+
+    static const char magic[8] = { 'm', 'i', 'n', 'i', 'u', 't', 'f', 'C' };
+    const char * bytes = static_cast<const char *>(blob);
+    if (std::memcmp(bytes, magic, sizeof(magic)) != 0)
+        return false;
+
+    uint32_t header[collation_blob_header_words];
+    std::memcpy(header, bytes + 8, sizeof(header));
+    const uint32_t format = header[0], unicode_version = header[1], checksum = header[2],
+                   data_len = header[3], bucket_count = header[4];
+    if (format != collation_blob_format || unicode_version != collation_blob_unicode_version)
+        return false;
+    if ((size - collation_blob_header_size) / 4 != uint64_t(data_len) + bucket_count
+        || (size - collation_blob_header_size) % 4)
+        return false;
+
+    // The checksum covers the whole table, so checking it here would read every page of an
+    // mmapped blob up front; that's left to verify_collation_data.
+    const unsigned char * payload =
+        reinterpret_cast<const unsigned char *>(bytes + collation_blob_header_size);
+
+    const uint32_t * data = reinterpret_cast<const uint32_t *>(payload);
+    const uint32_t * bucket_indexes = data + data_len;
+    if (header[5] != bucket_count || bucket_count == 0 || header[7] > max_key_length)
+        return false;
+    if (!collation_records_valid(data, data_len, bucket_indexes, bucket_count, header + 5))
+        return false;
+
+    ducet_blob_tables & tables = ducet_blob();
+    tables.data = data;
+    tables.data_end = data + data_len;
+    tables.bucket_indexes = bucket_indexes;
+    std::memcpy(tables.params, header + 5, sizeof(tables.params));
+    tables.payload = payload;
+    tables.payload_size = size - collation_blob_header_size;
+    tables.checksum = checksum;
+    return true;
+}
+
+MINIUTF_INLINE
+bool verify_collation_data() {
+    const ducet_blob_tables & tables = ducet_blob();
+    return tables.payload
+           && fnv1a(tables.payload, tables.payload + tables.payload_size) == tables.checksum;
+}
+
+MINIUTF_INLINE
+bool load_collation_data_file(const char * path) {
+#if defined(__unix__) || defined(__APPLE__)
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        close(fd);
+        return false;
+    }
+
+    void * blob = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (blob == MAP_FAILED)
+        return false;
+
+    // On success the mapping is kept for the life of the process.
+    if (!load_collation_data(blob, st.st_size)) {
+        munmap(blob, st.st_size);
+        return false;
+    }
+    return true;
+#else
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file)
+        return false;
+    size_t size = file.tellg();
+    file.seekg(0);
+
+    // No mmap here, so read the file into memory that's kept for the life of the process.
+    static std::vector<uint32_t> * blob = new std::vector<uint32_t>;
+    std::vector<uint32_t> buffer((size + 3) / 4);
+    if (!file.read(reinterpret_cast<char *>(buffer.data()), size))
+        return false;
+    if (!load_collation_data(buffer.data(), size))
+        return false;
+    blob->swap(buffer);
+    return true;
+#endif
+}
+
+#else
+
+#include "miniutfdata_collation.h"
+
+static_assert(DUCET_LONGEST_KEY <= max_key_length, "DUCET keys too long");
+
+MINIUTF_LOCAL bool ducet_loaded() { return true; }
+MINIUTF_LOCAL const uint32_t * ducet_data_begin() { return std::begin(ducet_data); }
+MINIUTF_LOCAL const uint32_t * ducet_data_end() { return std::end(ducet_data); }
+MINIUTF_LOCAL uint32_t ducet_bucket_index(size_t hash) { return ducet_bucket_indexes[hash]; }
+
+#endif
+
 /* Return the hash of the given range.
  */
 template <typename IterType>
-static size_t hash_key(IterType begin, IterType end) {
+MINIUTF_LOCAL
+size_t hash_key(IterType begin, IterType end) {
     size_t hash = 0;
     while (begin != end) {
         hash = (hash * DUCET_HASH_MULTIPLIER + *begin) % DUCET_HASH_BUCKETS;
@@ -52,13 +271,22 @@ static size_t hash_key(IterType begin, IterType end) {
  * the input is found, the returned pointer will always be non-null, though the length
  * may be 0 to indicate an empty mapping. If not found, the returned pointer will be null.
  */
-static std::pair<const uint32_t *, int> find_elements(const char32_t * begin,
-                                                      const char32_t * end) {
+MINIUTF_LOCAL
+std::pair<const uint32_t *, int> find_elements(const char32_t * begin,
+                                               const char32_t * end) {
+    if (!ducet_loaded()) {
+        // With MINIUTF_EXTERNAL_COLLATION_DATA, load_collation_data must come first. Every
+        // key would silently be wrong otherwise, so fail loudly, even without asserts.
+        assert(!"collation function called before load_collation_data");
+        std::abort();
+    }
+
+    MINIUTF_STAT(ducet_probes, 1);
     size_t hash = hash_key(begin, end);
 
-    const uint32_t * entry = std::begin(ducet_data) + ducet_bucket_indexes[hash];
+    const uint32_t * entry = ducet_data_begin() + ducet_bucket_index(hash);
 
-    while (entry < std::end(ducet_data)) {
+    while (entry < ducet_data_end()) {
         uint32_t key_len = (entry[0] >> (DUCET_DATA_HIGH_BIT - DUCET_KEY_BITS))
                             & ~(~0ULL << DUCET_KEY_BITS);
         uint32_t value_len = (entry[0] >> (DUCET_DATA_HIGH_BIT - DUCET_KEY_BITS
@@ -85,18 +313,33 @@ static std::pair<const uint32_t *, int> find_elements(const char32_t * begin,
     return { nullptr, 0 };
 }
 
-// in miniutf.cpp.
-int32_t ccc(int32_t codepoint);
+#include "miniutfdata.h"
+
+// Collation elements are packed as primary << 16 | secondary << 5 | tertiary; see
+// make_collation_element_table in preprocess.py.
+MINIUTF_LOCAL
+uint32_t element_weight(uint32_t element, int level) {
+    switch (level) {
+        case 1:  return element >> DUCET_L1_SHIFT;
+        case 2:  return (element & ~(~0U << DUCET_L1_SHIFT)) >> DUCET_L2_SHIFT;
+        default: return element & ~(~0U << DUCET_L2_SHIFT);
+    }
+}
 
 /*
  * Finds the DUCET collation elements at position i in a string, adds its length to i, and
- * appends the collation elements to the given vector. We only deal with level 1 here.
+ * appends the (packed) collation elements to the given vector.
+ *
+ * If offsets is non-null, it runs parallel to str and is reordered along with it.
  */
-void get_ducet_level1(std::u32string & str,
-                      size_t & i,
-                      std::vector<uint32_t> & elements) {
+MINIUTF_LOCAL
+void get_ducet_elements(std::u32string & str,
+                        size_t & i,
+                        std::vector<uint32_t> & elements,
+                        std::vector<std::string::size_type> * offsets) {
 
     assert(i < str.size());
+    MINIUTF_STAT_GROWTH(elements);
 
     std::pair<const uint32_t *, int> best_key { nullptr, 0 };
     size_t best_length = 0;
@@ -113,7 +356,7 @@ void get_ducet_level1(std::u32string & str,
 
     // S2.1.1. If there are any non-starters following S, process each non-starter C.
 
-    std::unordered_set<int32_t> blocked_classes;
+    std::bitset<256> blocked_classes;
 
     if (best_key.first) {
         size_t j = best_length;
@@ -128,26 +371,37 @@ void get_ducet_level1(std::u32string & str,
             // Note: A non-starter in a string is called blocked if there is another
             // non-starter of the same canonical combining class or zero between it and the
             // last character of canonical combining class 0.
-            if (!blocked_classes.count(ccc_C)) {
-
-                // TODO(j4cbo): Would be nice to eliminate this copy.
-                std::u32string SC { str.data() + i, str.data() + i + best_length };
-                SC += C;
-
-                auto itr = find_elements(SC.data(), SC.data() + SC.size());
+            if (!blocked_classes[ccc_C]) {
+                MINIUTF_STAT(contraction_checks, 1);
+
+                // S + C can only be in the table if it's no longer than the longest key.
+                std::pair<const uint32_t *, int> itr { nullptr, 0 };
+                if (best_length < DUCET_LONGEST_KEY) {
+                    char32_t SC[max_key_length];
+                    std::copy(str.data() + i, str.data() + i + best_length, SC);
+                    SC[best_length] = C;
+                    itr = find_elements(SC, SC + best_length + 1);
+                }
 
                 // S2.1.3 If there is a match, replace S by S + C, and remove C.
                 if (itr.first) {
                     std::copy_backward(str.begin() + i + best_length, str.begin() + i + j,
                                        str.begin() + i + j + 1);
                     str[i + best_length] = C;
+                    if (offsets) {
+                        std::string::size_type C_offset = (*offsets)[i + j];
+                        std::copy_backward(offsets->begin() + i + best_length,
+                                           offsets->begin() + i + j,
+                                           offsets->begin() + i + j + 1);
+                        (*offsets)[i + best_length] = C_offset;
+                    }
                     best_key = itr;
                     best_length++;
                     break;
                 }
             }
 
-            blocked_classes.emplace(ccc_C);
+            blocked_classes[ccc_C] = true;
             j++;
         }
     }
@@ -189,27 +443,163 @@ void get_ducet_level1(std::u32string & str,
         base = 0xfb80;
     }
 
+    // The derived elements are [.AAAA.0020.0002][.BBBB.0000.0000].
     char32_t aaaa = base + (pt >> 15);
     char32_t bbbb = (pt & 0x7fff) | 0x8000;
 
-    elements.push_back(aaaa);
-    elements.push_back(bbbb);
+    elements.push_back(aaaa << DUCET_L1_SHIFT | 0x20 << DUCET_L2_SHIFT | 0x02);
+    elements.push_back(bbbb << DUCET_L1_SHIFT);
 }
 
-std::vector<uint32_t> match_key(const std::string & in) {
+/*
+ * Append the packed collation elements for in to elements. codepoints and offsets are
+ * scratch space.
+ *
+ * If ranges is non-null, also append, for each element, the range of bytes [first, second)
+ * in `in` of the characters it was generated from.
+ */
+MINIUTF_LOCAL
+void get_collation_elements(const std::string & in,
+                            std::vector<uint32_t> & elements,
+                            std::vector<byte_range> * ranges,
+                            std::u32string & codepoints,
+                            std::vector<std::string::size_type> & offsets) {
 
     // S1.1 Use the Unicode canonical algorithm to decompose characters according to the
     // canonical mappings. That is, put the string into Normalization Form D (see [UAX15]).
-    std::u32string codepoints = normalize32(in, false, nullptr);
+    normalize32(in, false, codepoints, nullptr, ranges ? &offsets : nullptr);
 
-    std::vector<uint32_t> key;
-    key.reserve(codepoints.size());
+    counted_reserve(elements, elements.size() + codepoints.size());
 
     for (size_t i = 0; i < codepoints.size(); ) {
-        get_ducet_level1(codepoints,i,key);
+        size_t first = i;
+        get_ducet_elements(codepoints, i, elements, ranges ? &offsets : nullptr);
+
+        if (ranges) {
+            byte_range range { std::string::npos, 0 };
+            for (size_t j = first; j < i; j++) {
+                std::string::size_type pos = offsets[j];
+                range.first = std::min(range.first, pos);
+                utf8_decode(in, pos);
+                range.second = std::max(range.second, pos);
+            }
+            MINIUTF_STAT_GROWTH(*ranges);
+            ranges->resize(elements.size(), range);
+        }
     }
+}
 
+/*
+ * Replace packed collation elements with their nonzero primary weights, in place. If ranges
+ * is non-null, it is compacted to match; characters with no primary weight (e.g. combining
+ * accents) are folded into the range of the preceding weight.
+ */
+MINIUTF_LOCAL
+void keep_primary_weights(std::vector<uint32_t> & key, std::vector<byte_range> * ranges) {
+    size_t n = 0;
+    for (size_t j = 0; j < key.size(); j++) {
+        if (uint32_t weight = element_weight(key[j], 1)) {
+            key[n] = weight;
+            if (ranges)
+                (*ranges)[n] = (*ranges)[j];
+            n++;
+        } else if (ranges && n > 0) {
+            (*ranges)[n-1].second = std::max((*ranges)[n-1].second, (*ranges)[j].second);
+        }
+    }
+    key.resize(n);
+    if (ranges)
+        ranges->resize(n);
+}
+
+MINIUTF_INLINE
+std::vector<uint32_t> match_key(const std::string & in, std::vector<byte_range> * ranges) {
+    std::vector<uint32_t> key;
+    std::u32string codepoints;
+    std::vector<std::string::size_type> offsets;
+    if (ranges)
+        ranges->clear();
+    get_collation_elements(in, key, ranges, codepoints, offsets);
+    keep_primary_weights(key, ranges);
     return key;
 }
 
+MINIUTF_INLINE
+const std::vector<uint32_t> & match_key(const std::string & in, context & ctx,
+                                        std::vector<byte_range> * ranges) {
+    ctx.m_key.clear();
+    if (ranges)
+        ranges->clear();
+    get_collation_elements(in, ctx.m_key, ranges, ctx.m_codepoints, ctx.m_offsets);
+    keep_primary_weights(ctx.m_key, ranges);
+    return ctx.m_key;
+}
+
+MINIUTF_INLINE
+std::vector<uint32_t> sort_key(const std::string & in, int levels) {
+    std::vector<uint32_t> elements;
+    std::u32string codepoints;
+    std::vector<std::string::size_type> offsets;
+    get_collation_elements(in, elements, nullptr, codepoints, offsets);
+
+    levels = std::max(1, std::min(levels, 3));
+
+    // S3 Form a sort key: the nonzero weights of each level in turn, with a 0 separating
+    // the levels. (A 0 sorts below any weight, so a string whose weights at some level
+    // are a prefix of another's sorts first.)
+    std::vector<uint32_t> key;
+    counted_reserve(key, elements.size() * levels + levels - 1);
+    for (int level = 1; level <= levels; level++) {
+        if (level > 1)
+            key.push_back(0);
+        for (uint32_t element : elements) {
+            if (uint32_t weight = element_weight(element, level))
+                key.push_back(weight);
+        }
+    }
+
+    return key;
+}
+
+MINIUTF_INLINE
+std::pair<std::string::size_type, std::string::size_type>
+collation_find(const std::string & haystack,
+               const std::string & needle,
+               std::string::size_type pos) {
+
+    const std::vector<uint32_t> pattern = match_key(needle);
+    if (pattern.empty()) {
+        if (pos > haystack.size())
+            return { std::string::npos, 0 };
+        return { pos, 0 };
+    }
+
+    std::vector<byte_range> ranges;
+    const std::vector<uint32_t> text = match_key(haystack, &ranges);
+
+    size_t start = 0;
+    while (start < text.size() && ranges[start].first < pos)
+        start++;
+
+    // Boyer-Moore-Horspool over the weights. The shift table is indexed by the low byte of
+    // each weight; weights that share a low byte share the smallest shift, which is safe.
+    const size_t m = pattern.size();
+    size_t shift[256];
+    std::fill(std::begin(shift), std::end(shift), m);
+    for (size_t k = 0; k + 1 < m; k++)
+        shift[pattern[k] & 0xFF] = m - 1 - k;
+
+    for (size_t k = start; k + m <= text.size(); k += shift[text[k + m - 1] & 0xFF]) {
+        if (text[k + m - 1] == pattern[m - 1]
+            && std::equal(pattern.begin(), pattern.end() - 1, text.begin() + k)) {
+            std::string::size_type begin = ranges[k].first, end = 0;
+            for (size_t j = k; j < k + m; j++)
+                end = std::max(end, ranges[j].second);
+            return { begin, end - begin };
+        }
+    }
+
+    return { std::string::npos, 0 };
+}
+
 } // namespace miniutf
@@ -27,14 +27,95 @@
 
 namespace miniutf {
 
-/* match_key(in)
+typedef std::pair<std::string::size_type, std::string::size_type> byte_range;
+
+#ifdef MINIUTF_EXTERNAL_COLLATION_DATA
+/* load_collation_data(data, size)
+ * load_collation_data_file(path)
+ *
+ * When miniutf is built with MINIUTF_EXTERNAL_COLLATION_DATA, the DUCET isn't compiled in.
+ * Instead it's read at runtime from a blob generated by `python preprocess.py --collation-blob`
+ * (see the miniutfdata_collation.bin target in the Makefile). One of these must be called
+ * once, before any other collation function; calling a collation function with no data
+ * loaded aborts.
+ *
+ * load_collation_data uses the blob in place, so data must be 4-byte aligned and must stay
+ * valid for the life of the process. load_collation_data_file maps the file read-only, so
+ * every process using it shares one copy in the page cache.
+ *
+ * Returns false if the blob can't be read, has a bad header or bucket table, has a record
+ * that doesn't fit in the table, or was generated for a different format or Unicode version.
+ * Checking the records reads the whole table once, so a truncated or corrupt blob is refused
+ * here rather than read past by a lookup; the checksum is left to verify_collation_data.
+ */
+bool load_collation_data(const void * data, size_t size);
+bool load_collation_data_file(const char * path);
+
+/* verify_collation_data()
+ *
+ * Checks the whole loaded blob against its checksum, reading every page of it. Returns false
+ * if it doesn't match or if no blob is loaded. Worth calling once after installing a new blob,
+ * or in tests; load_collation_data doesn't.
+ */
+bool verify_collation_data();
+#endif
+
+/* match_key(in, ranges)
  *
  * Returns the level 1 sort key (no identical level), for use in user-facing searching.
  *
  * The key is generated using a truncated version of DUCET:
  * http://www.unicode.org/Public/UCA/6.3.0/allkeys.txt
  *
+ * If ranges is specified, it's filled with one entry per weight in the key: the range of bytes
+ * [first, second) in `in` of the characters that weight came from, for highlighting matches.
+ * This accounts for decomposition and for contractions that pull in a later combining mark;
+ * characters with no level 1 weight (e.g. combining accents) are included in the range of
+ * the preceding weight. Ranges are only tracked if requested.
  */
-std::vector<uint32_t> match_key(const std::string & in);
+std::vector<uint32_t> match_key(const std::string & in,
+                                std::vector<byte_range> * ranges = nullptr);
+
+/* match_key(in, ctx, ranges)
+ *
+ * The same, but working in ctx's buffers (see miniutf::context). The key is valid until ctx
+ * is next used. If ranges is specified, it's reused too.
+ */
+const std::vector<uint32_t> & match_key(const std::string & in,
+                                        context & ctx,
+                                        std::vector<byte_range> * ranges = nullptr);
+
+/* sort_key(in, levels)
+ *
+ * Returns the sort key for the first `levels` levels (1 to 3; no identical level), for use in
+ * user-facing sorting. Level 2 distinguishes accents and level 3 distinguishes case and
+ * variants.
+ *
+ * The key is the nonzero weights of each level in turn, with a 0 between levels; keys
+ * compare in collation order with the usual std::vector comparison. sort_key(in, 1) is the
+ * same as match_key(in).
+ */
+std::vector<uint32_t> sort_key(const std::string & in, int levels = 3);
+
+/* collation_find(haystack, needle, pos)
+ *
+ * Searches haystack for needle, comparing level 1 keys (so the search is case- and
+ * accent-insensitive), starting at byte offset pos. The needle's key is built once and
+ * the haystack's key is searched with Boyer-Moore-Horspool.
+ *
+ * Returns the byte offset and length in haystack of the first match, or { npos, 0 } if there
+ * is none. A match covers whole characters, including any combining accents that follow
+ * the last matched character. A character that expands to several weights is included in
+ * full even if the match only covers some of them: searching for "s" in "ß" (which is
+ * keyed as "ss") matches the whole "ß".
+ */
+std::pair<std::string::size_type, std::string::size_type>
+collation_find(const std::string & haystack,
+               const std::string & needle,
+               std::string::size_type pos = 0);
+
+} // namespace miniutf
 
-}
+#ifdef MINIUTF_HEADER_ONLY
+#include "miniutf_collation.cpp"
+#endif
@@ -0,0 +1,575 @@
+/* Copyright (c) 2013 Dropbox, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "miniutf_index.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+namespace miniutf {
+
+/* * * * * * * * * *
+ * Image layout
+ * * * * * * * * * */
+
+struct index_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t count;
+    uint64_t keys_size;
+};
+
+// Keys are stored in entry order, so each entry's key starts where the previous one's ends.
+struct index_entry {
+    uint64_t key_end; // offset in the keys section of the end of this entry's key
+    prefix_index::value_type value;
+};
+
+static const uint32_t prefix_index_magic = 0x7846554d; // "MUFx"
+static const uint32_t prefix_index_version = 2;
+
+static const index_entry * image_entries(const char * image) {
+    return reinterpret_cast<const index_entry *>(image + sizeof(index_header));
+}
+
+/*
+ * Return the start and length of the key of e, one of the entries starting at entries, whose
+ * keys start at keys.
+ */
+static std::pair<const char *, size_t> entry_key(const index_entry * entries, const char * keys,
+                                                 const index_entry & e) {
+    const uint64_t key_begin = &e == entries ? 0 : (&e)[-1].key_end;
+    return { keys + key_begin, e.key_end - key_begin };
+}
+
+/*
+ * Encode the level 1 key of name as bytes, two big-endian bytes per weight. Level 1 weights
+ * are at most 16 bits, so comparing the bytes gives the same order as comparing the keys.
+ */
+static std::string key_bytes(const std::string & name) {
+    std::vector<uint32_t> key = match_key(name);
+    std::string out;
+    out.reserve(key.size() * 2);
+    for (uint32_t weight : key) {
+        out += static_cast<char>(weight >> 8);
+        out += static_cast<char>(weight & 0xFF);
+    }
+    return out;
+}
+
+/*
+ * Compare key [key, key + length) with prefix, treating a key that starts with prefix as
+ * equal to it.
+ */
+static int compare_prefix(const char * key, size_t length, const std::string & prefix) {
+    int res = std::memcmp(key, prefix.data(), std::min(length, prefix.size()));
+    if (res == 0 && length < prefix.size())
+        return -1;
+    return res;
+}
+
+/*
+ * Return true if key a, as a start and length, sorts at or before key b.
+ */
+static bool key_less_equal(std::pair<const char *, size_t> a, const std::string & b) {
+    int res = std::memcmp(a.first, b.data(), std::min(a.second, b.size()));
+    return res < 0 || (res == 0 && a.second <= b.size());
+}
+
+/*
+ * Serialize sorted (key, value) pairs into an image.
+ */
+template <typename Iter>
+static void write_image(Iter begin, Iter end, uint64_t count, std::vector<uint64_t> & out) {
+    uint64_t keys_size = 0;
+    for (Iter it = begin; it != end; ++it)
+        keys_size += it->first.size();
+
+    const size_t entries_offset = sizeof(index_header);
+    const size_t keys_offset = entries_offset + count * sizeof(index_entry);
+    out.assign((keys_offset + keys_size + 7) / 8, 0);
+
+    char * base = reinterpret_cast<char *>(out.data());
+    index_header header { prefix_index_magic, prefix_index_version, count, keys_size };
+    std::memcpy(base, &header, sizeof(header));
+
+    uint64_t key_end = 0;
+    for (size_t i = 0; begin != end; ++begin, ++i) {
+        std::memcpy(base + keys_offset + key_end, begin->first.data(), begin->first.size());
+        key_end += begin->first.size();
+        index_entry e { key_end, begin->second };
+        std::memcpy(base + entries_offset + i * sizeof(e), &e, sizeof(e));
+    }
+}
+
+/* * * * * * * * * *
+ * prefix_index
+ * * * * * * * * * */
+
+prefix_index::prefix_index() : m_attached(nullptr) {}
+
+const char * prefix_index::data() const {
+    return m_attached ? m_attached : reinterpret_cast<const char *>(m_owned.data());
+}
+
+uint64_t prefix_index::count() const {
+    if (!m_attached && m_owned.empty())
+        return 0;
+    return reinterpret_cast<const index_header *>(data())->count;
+}
+
+size_t prefix_index::size() const {
+    return count() + m_pending.size();
+}
+
+void prefix_index::build(const std::vector<std::pair<std::string, value_type>> & entries) {
+    std::vector<std::pair<std::string, value_type>> keyed;
+    keyed.reserve(entries.size());
+    for (const auto & e : entries)
+        keyed.emplace_back(key_bytes(e.first), e.second);
+    std::sort(keyed.begin(), keyed.end());
+
+    m_attached = nullptr;
+    m_pending.clear();
+    write_image(keyed.begin(), keyed.end(), keyed.size(), m_owned);
+}
+
+void prefix_index::insert(const std::string & name, value_type value) {
+    m_pending.emplace(key_bytes(name), value);
+    if (m_pending.size() > std::max<uint64_t>(1024, count() / 8))
+        merge_pending();
+}
+
+void prefix_index::merge_pending() {
+    const char * keys = data() + sizeof(index_header) + count() * sizeof(index_entry);
+
+    std::vector<std::pair<std::string, value_type>> merged;
+    merged.reserve(size());
+    auto pending = m_pending.begin();
+    const index_entry * entries = image_entries(data());
+    for (const index_entry * e = entries, * end = e + count(); e != end; ++e) {
+        const auto stored = entry_key(entries, keys, *e);
+        std::string key(stored.first, stored.second);
+        for (; pending != m_pending.end() && pending->first < key; ++pending)
+            merged.emplace_back(*pending);
+        merged.emplace_back(std::move(key), e->value);
+    }
+    merged.insert(merged.end(), pending, m_pending.end());
+
+    std::vector<uint64_t> image;
+    write_image(merged.begin(), merged.end(), merged.size(), image);
+    m_owned.swap(image);
+    m_attached = nullptr;
+    m_pending.clear();
+}
+
+std::vector<prefix_index::value_type>
+prefix_index::find_prefix(const std::string & prefix, size_t limit) const {
+    const std::string key = key_bytes(prefix);
+    const char * keys = data() + sizeof(index_header) + count() * sizeof(index_entry);
+
+    // The entries starting with key form one contiguous range in each of the image and the
+    // pending set.
+    const index_entry * entries = image_entries(data());
+    const index_entry * first = entries, * last = first + count();
+    first = std::partition_point(first, last, [&] (const index_entry & e) {
+        const auto stored = entry_key(entries, keys, e);
+        return compare_prefix(stored.first, stored.second, key) < 0;
+    });
+    last = std::partition_point(first, last, [&] (const index_entry & e) {
+        const auto stored = entry_key(entries, keys, e);
+        return compare_prefix(stored.first, stored.second, key) == 0;
+    });
+
+    auto pending = m_pending.lower_bound(key);
+    auto pending_matches = [&] () {
+        return pending != m_pending.end()
+            && compare_prefix(pending->first.data(), pending->first.size(), key) == 0;
+    };
+
+    // Merge the two ranges in key order.
+    std::vector<value_type> out;
+    while (out.size() < limit && (first != last || pending_matches())) {
+        if (first != last
+            && (!pending_matches()
+                || key_less_equal(entry_key(entries, keys, *first), pending->first))) {
+            out.push_back(first->value);
+            ++first;
+        } else {
+            out.push_back(pending->second);
+            ++pending;
+        }
+    }
+
+    return out;
+}
+
+std::string prefix_index::image() const {
+    if (!m_pending.empty()) {
+        prefix_index copy(*this);
+        copy.merge_pending();
+        return copy.image();
+    }
+
+    if (!m_attached && m_owned.empty()) {
+        index_header header { prefix_index_magic, prefix_index_version, 0, 0 };
+        return std::string(reinterpret_cast<const char *>(&header), sizeof(header));
+    }
+
+    const index_header * header = reinterpret_cast<const index_header *>(data());
+    return std::string(data(), sizeof(index_header) + header->count * sizeof(index_entry)
+                                                    + header->keys_size);
+}
+
+bool prefix_index::attach(const void * image, size_t size) {
+    m_attached = nullptr;
+    m_owned.clear();
+    m_pending.clear();
+
+    if (reinterpret_cast<uintptr_t>(image) % alignof(index_entry) || size < sizeof(index_header))
+        return false;
+
+    const index_header * header = static_cast<const index_header *>(image);
+    if (header->magic != prefix_index_magic || header->version != prefix_index_version)
+        return false;
+    if (header->count > (size - sizeof(index_header)) / sizeof(index_entry)
+        || header->keys_size > size - sizeof(index_header) - header->count * sizeof(index_entry))
+        return false;
+
+    // Every key must lie within the keys section, after the one before it; lookups read them
+    // without checking.
+    uint64_t key_end = 0;
+    const index_entry * e = image_entries(static_cast<const char *>(image));
+    for (const index_entry * end = e + header->count; e != end; ++e) {
+        if (e->key_end < key_end || e->key_end > header->keys_size)
+            return false;
+        key_end = e->key_end;
+    }
+
+    m_attached = static_cast<const char *>(image);
+    return true;
+}
+
+/* * * * * * * * * *
+ * folded_name_index
+ * * * * * * * * * */
+
+// Per-thread scratch space for folding names that aren't ASCII.
+struct fold_scratch {
+    std::string name;
+    std::u32string query;
+    std::u32string stored;
+};
+
+static fold_scratch & thread_scratch() {
+    static thread_local fold_scratch scratch;
+    return scratch;
+}
+
+static bool all_ascii(const char * data, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        if (static_cast<unsigned char>(data[i]) >= 0x80)
+            return false;
+    }
+    return true;
+}
+
+static char32_t ascii_lower(char c) {
+    return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+/*
+ * Fold name into out, as codepoints: lowercase(nfc(name)).
+ */
+static void fold(const std::string & name, std::u32string & out) {
+    normalize32(name, true, out);
+    for (char32_t & pt : out)
+        pt = lowercase(pt);
+}
+
+static uint64_t hash_step(uint64_t h, char32_t pt) {
+    return (h ^ pt) * 0x100000001B3ULL;
+}
+
+static uint32_t hash_finish(uint64_t h) {
+    // Mix the high bits into the low ones, which pick the slot.
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    return static_cast<uint32_t>(h);
+}
+
+/*
+ * Hash the folded form of name. If name isn't ASCII, its folded form is left in folded.
+ */
+static uint32_t folded_hash(const std::string & name, bool & ascii, std::u32string & folded) {
+    uint64_t h = 0xCBF29CE484222325ULL;
+    ascii = all_ascii(name.data(), name.size());
+    if (ascii) {
+        for (char c : name)
+            h = hash_step(h, ascii_lower(c));
+    } else {
+        fold(name, folded);
+        for (char32_t pt : folded)
+            h = hash_step(h, pt);
+    }
+    return hash_finish(h);
+}
+
+folded_name_index::folded_name_index() : m_slots(16), m_groups(0) {}
+
+/*
+ * Does e's name have the same folded form as name? ascii and folded are as from folded_hash.
+ */
+bool folded_name_index::same_folded(const std::string & name, bool ascii,
+                                    const std::u32string & folded, const entry & e) const {
+    const char * stored = m_names.data() + e.name_offset;
+    const size_t length = e.name_length;
+    if (ascii && all_ascii(stored, length)) {
+        if (length != name.size())
+            return false;
+        for (size_t i = 0; i < length; i++) {
+            if (ascii_lower(stored[i]) != ascii_lower(name[i]))
+                return false;
+        }
+        return true;
+    }
+
+    fold_scratch & scratch = thread_scratch();
+    scratch.name.assign(stored, length);
+    fold(scratch.name, scratch.stored);
+    if (!ascii)
+        return scratch.stored == folded;
+
+    if (scratch.stored.size() != name.size())
+        return false;
+    for (size_t i = 0; i < name.size(); i++) {
+        if (scratch.stored[i] != ascii_lower(name[i]))
+            return false;
+    }
+    return true;
+}
+
+/*
+ * Return the slot holding name's group, or the empty slot where it would go.
+ */
+size_t folded_name_index::find_slot(const std::string & name, bool ascii,
+                                    const std::u32string & folded, uint32_t hash) const {
+    const size_t mask = m_slots.size() - 1;
+    for (size_t i = hash & mask; ; i = (i + 1) & mask) {
+        const slot & s = m_slots[i];
+        if (!s.group)
+            return i;
+        if (s.hash == hash && same_folded(name, ascii, folded, m_entries[s.group - 1]))
+            return i;
+    }
+}
+
+/*
+ * Rehash into the given number of slots, which must be a power of two. The slots keep their
+ * hashes, so this doesn't look at the names.
+ */
+void folded_name_index::grow(size_t slots) {
+    std::vector<slot> old(slots);
+    old.swap(m_slots);
+    const size_t mask = slots - 1;
+    for (const slot & s : old) {
+        if (!s.group)
+            continue;
+        size_t i = s.hash & mask;
+        while (m_slots[i].group)
+            i = (i + 1) & mask;
+        m_slots[i] = s;
+    }
+}
+
+void folded_name_index::reserve(size_t entries, size_t names_size) {
+    m_entries.reserve(entries);
+    m_names.reserve(names_size);
+
+    // Keep the table at most three quarters full.
+    size_t slots = m_slots.size();
+    while (slots / 4 * 3 < entries)
+        slots *= 2;
+    if (slots != m_slots.size())
+        grow(slots);
+}
+
+void folded_name_index::build(const std::vector<std::pair<std::string, value_type>> & entries) {
+    m_names.clear();
+    m_entries.clear();
+    m_slots.assign(16, slot());
+    m_groups = 0;
+
+    size_t names_size = 0;
+    for (const auto & e : entries)
+        names_size += e.first.size();
+    reserve(entries.size(), names_size);
+
+    for (const auto & e : entries)
+        insert(e.first, e.second);
+}
+
+void folded_name_index::insert(const std::string & name, value_type value) {
+    if (m_groups + 1 > m_slots.size() / 4 * 3)
+        grow(m_slots.size() * 2);
+
+    bool ascii;
+    fold_scratch & scratch = thread_scratch();
+    const uint32_t hash = folded_hash(name, ascii, scratch.query);
+    slot & s = m_slots[find_slot(name, ascii, scratch.query, hash)];
+
+    const uint32_t index = static_cast<uint32_t>(m_entries.size() + 1);
+    m_entries.push_back({ m_names.size(), static_cast<uint32_t>(name.size()), index, value });
+    m_names += name;
+
+    if (!s.group) {
+        s.hash = hash;
+        m_groups++;
+    } else {
+        // Link the new entry in after the last one, and before the first.
+        entry & last = m_entries[s.group - 1];
+        m_entries.back().next = last.next;
+        last.next = index;
+    }
+    s.group = index;
+}
+
+/*
+ * Append the values of the group whose last entry is last (plus one) to out, first to last.
+ */
+void folded_name_index::group_values(uint32_t last, std::vector<value_type> & out) const {
+    if (!last)
+        return;
+    uint32_t i = last;
+    do {
+        i = m_entries[i - 1].next;
+        out.push_back(m_entries[i - 1].value);
+    } while (i != last);
+}
+
+std::vector<folded_name_index::value_type>
+folded_name_index::find(const std::string & name) const {
+    bool ascii;
+    fold_scratch & scratch = thread_scratch();
+    const uint32_t hash = folded_hash(name, ascii, scratch.query);
+    std::vector<value_type> out;
+    group_values(m_slots[find_slot(name, ascii, scratch.query, hash)].group, out);
+    return out;
+}
+
+std::vector<std::vector<folded_name_index::value_type>> folded_name_index::collisions() const {
+    // Pairs of (first entry, last entry) of groups with more than one entry.
+    std::vector<std::pair<uint32_t, uint32_t>> groups;
+    for (const slot & s : m_slots) {
+        if (s.group && m_entries[s.group - 1].next != s.group)
+            groups.emplace_back(m_entries[s.group - 1].next, s.group);
+    }
+    std::sort(groups.begin(), groups.end());
+
+    std::vector<std::vector<value_type>> out(groups.size());
+    for (size_t g = 0; g < groups.size(); g++)
+        group_values(groups[g].second, out[g]);
+    return out;
+}
+
+size_t folded_name_index::size() const {
+    return m_entries.size();
+}
+
+/* * * * * * * * * *
+ * offset_index
+ * * * * * * * * * */
+
+offset_index::offset_index(const std::string & str, size_type interval)
+    : m_interval(std::max<size_type>(interval, 1)), m_end { 0, 0, 0 } {
+    while (m_end.byte < str.size()) {
+        if (m_end.codepoint % m_interval == 0)
+            m_checkpoints.push_back(m_end);
+        step(str, m_end);
+    }
+    if (m_checkpoints.empty())
+        m_checkpoints.push_back(m_end);
+}
+
+offset_index::size_type offset_index::codepoints() const {
+    return m_end.codepoint;
+}
+
+offset_index::size_type offset_index::utf16_length() const {
+    return m_end.utf16;
+}
+
+/*
+ * Move c past the codepoint at c.byte.
+ */
+void offset_index::step(const std::string & str, checkpoint & c) {
+    if (static_cast<unsigned char>(str[c.byte]) < 0x80) {
+        c.byte++;
+    } else if (utf8_decode(str, c.byte) >= 0x10000) {
+        c.utf16++;
+    }
+    c.codepoint++;
+    c.utf16++;
+}
+
+/*
+ * Return the position of the codepoint that contains target, measured in field. target must
+ * be less than m_end.*field.
+ */
+offset_index::checkpoint offset_index::find(const std::string & str,
+                                            size_type checkpoint::* field,
+                                            size_type target) const {
+    auto after = std::upper_bound(m_checkpoints.begin(), m_checkpoints.end(), target,
+                                  [field] (size_type t, const checkpoint & c) {
+                                      return t < c.*field;
+                                  });
+    checkpoint c = *(after - 1);
+    for (;;) {
+        checkpoint next = c;
+        step(str, next);
+        if (next.*field > target)
+            return c;
+        c = next;
+    }
+}
+
+offset_index::size_type offset_index::codepoint_to_byte(const std::string & str,
+                                                        size_type index) const {
+    return index < m_end.codepoint ? find(str, &checkpoint::codepoint, index).byte : m_end.byte;
+}
+
+offset_index::size_type offset_index::utf16_to_byte(const std::string & str,
+                                                    size_type index) const {
+    return index < m_end.utf16 ? find(str, &checkpoint::utf16, index).byte : m_end.byte;
+}
+
+offset_index::size_type offset_index::byte_to_codepoint(const std::string & str,
+                                                        size_type offset) const {
+    return offset < m_end.byte ? find(str, &checkpoint::byte, offset).codepoint : m_end.codepoint;
+}
+
+offset_index::size_type offset_index::byte_to_utf16(const std::string & str,
+                                                    size_type offset) const {
+    return offset < m_end.byte ? find(str, &checkpoint::byte, offset).utf16 : m_end.utf16;
+}
+
+} // namespace miniutf
@@ -0,0 +1,238 @@
+/* Copyright (c) 2013 Dropbox, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#pragma once
+
+#include "miniutf_collation.hpp"
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace miniutf {
+
+/* prefix_index
+ *
+ * A sorted index from level 1 collation keys (see match_key) to caller-supplied values, for
+ * case- and accent-insensitive prefix ("type-ahead") queries. Values are typically the offset
+ * of the name in the caller's own string table.
+ *
+ * The index is a single flat image: a header, an array of entries sorted by key, and the keys
+ * themselves (two big-endian bytes per weight, so that byte order is collation order). The
+ * image can be written out with image() and later used in place, e.g. from an mmap, with
+ * attach(). It's native-endian, so it should be read on the same architecture it was built on.
+ * Entries record where their keys end as 64-bit offsets, so the only limit on the number of
+ * entries or the size of the keys is memory.
+ *
+ * Inserts go into a small sorted overflow set, which is merged into the image once it grows
+ * past a fraction of the image's size, so that inserts are amortized O(log n).
+ */
+class prefix_index {
+public:
+    typedef uint64_t value_type;
+
+    prefix_index();
+
+    /*
+     * Replace the contents of the index with the given (name, value) entries.
+     */
+    void build(const std::vector<std::pair<std::string, value_type>> & entries);
+
+    /*
+     * Add a single entry.
+     */
+    void insert(const std::string & name, value_type value);
+
+    /*
+     * Return the values of all entries whose key starts with the key of prefix, in key order,
+     * stopping after limit results. An empty prefix matches every entry.
+     */
+    std::vector<value_type> find_prefix(const std::string & prefix,
+                                        size_t limit = SIZE_MAX) const;
+
+    /*
+     * Number of entries in the index.
+     */
+    size_t size() const;
+
+    /*
+     * Return the serialized image of the index, including any pending inserts.
+     */
+    std::string image() const;
+
+    /*
+     * Use an image produced by image() in place. data must be 8-byte aligned and must outlive
+     * the index (or the next call to build()). Returns false, leaving the index empty, if the
+     * image is malformed. Every entry is checked, so this is O(n).
+     */
+    bool attach(const void * data, size_t size);
+
+private:
+    const char * data() const;
+    uint64_t count() const;
+    void merge_pending();
+
+    std::vector<uint64_t> m_owned;
+    const char * m_attached;
+    std::multimap<std::string, value_type> m_pending;
+};
+
+/* folded_name_index
+ *
+ * A hash index from names to caller-supplied values that treats names as equal if they have
+ * the same folded form, lowercase(nfc(name)): e.g. "Cafe\u0301" and "CAF\u00C9". It's meant
+ * for finding names that collide on case- or normalization-insensitive filesystems, such as
+ * the entries of a shared folder.
+ *
+ * Each name is stored once, as given, in a single string table; the folded form is never
+ * stored, but hashed and compared on the fly. ASCII names, the common case, are folded byte by
+ * byte without decoding; others are folded into a per-thread scratch buffer. The table is open
+ * addressing with linear probing, and takes 8 bytes per slot plus 24 per entry, so tens of
+ * millions of entries fit in a few hundred megabytes. It holds at most 2^32 - 1 entries.
+ *
+ * Lookups may run concurrently with each other, but not with inserts.
+ */
+class folded_name_index {
+public:
+    typedef uint64_t value_type;
+
+    folded_name_index();
+
+    /*
+     * Make room for the given number of entries, with names totalling names_size bytes,
+     * without growing again.
+     */
+    void reserve(size_t entries, size_t names_size = 0);
+
+    /*
+     * Replace the contents of the index with the given (name, value) entries, e.g. a directory
+     * listing.
+     */
+    void build(const std::vector<std::pair<std::string, value_type>> & entries);
+
+    /*
+     * Add a single entry. Entries with the same name, or the same folded name, are all kept.
+     */
+    void insert(const std::string & name, value_type value);
+
+    /*
+     * Return the values of all entries whose folded name is the same as name's, in the order
+     * they were inserted.
+     */
+    std::vector<value_type> find(const std::string & name) const;
+
+    /*
+     * Return each group of two or more entries with the same folded name, as their values in
+     * insertion order. Groups are ordered by their first entry.
+     */
+    std::vector<std::vector<value_type>> collisions() const;
+
+    /*
+     * Number of entries in the index.
+     */
+    size_t size() const;
+
+private:
+    struct slot {
+        uint32_t hash;  // the folded name's hash
+        uint32_t group; // index of the group's last entry, plus one; 0 if the slot is empty
+    };
+
+    /*
+     * A group's entries form a circular list in insertion order: each links to the next, and
+     * the last links back to the first, so that appending doesn't walk the group.
+     */
+    struct entry {
+        uint64_t name_offset;
+        uint32_t name_length;
+        uint32_t next; // index of the group's next entry, plus one
+        value_type value;
+    };
+
+    bool same_folded(const std::string & name, bool ascii, const std::u32string & folded,
+                     const entry & e) const;
+    size_t find_slot(const std::string & name, bool ascii, const std::u32string & folded,
+                     uint32_t hash) const;
+    void grow(size_t slots);
+    void group_values(uint32_t last, std::vector<value_type> & out) const;
+
+    std::string m_names;
+    std::vector<entry> m_entries;
+    std::vector<slot> m_slots;
+    size_t m_groups;
+};
+
+/* offset_index
+ *
+ * Converts between byte offsets, codepoint indexes and UTF-16 code unit indexes in a UTF-8
+ * string, e.g. for clients that count in UTF-16. It keeps a checkpoint every interval
+ * codepoints, so each conversion is a binary search plus a scan of at most interval
+ * codepoints.
+ *
+ * The index doesn't keep a reference to the string: each conversion takes the string it was
+ * built from, which must not have changed since. A position inside a codepoint (or inside a
+ * surrogate pair) refers to the whole codepoint. Invalid UTF-8 is counted as by utf8_decode,
+ * as a U+FFFD for each invalid byte.
+ */
+class offset_index {
+public:
+    typedef std::string::size_type size_type;
+
+    explicit offset_index(const std::string & str, size_type interval = 64);
+
+    /*
+     * Length of the string in codepoints and in UTF-16 code units.
+     */
+    size_type codepoints() const;
+    size_type utf16_length() const;
+
+    /*
+     * Return the byte offset of the codepoint with the given index, or of the codepoint that
+     * contains the given UTF-16 code unit. Indexes past the end give str.size().
+     */
+    size_type codepoint_to_byte(const std::string & str, size_type index) const;
+    size_type utf16_to_byte(const std::string & str, size_type index) const;
+
+    /*
+     * Return the index of the codepoint that contains str[offset], or of its first UTF-16
+     * code unit. Offsets past the end give codepoints() or utf16_length().
+     */
+    size_type byte_to_codepoint(const std::string & str, size_type offset) const;
+    size_type byte_to_utf16(const std::string & str, size_type offset) const;
+
+private:
+    struct checkpoint {
+        size_type byte;
+        size_type codepoint;
+        size_type utf16;
+    };
+
+    static void step(const std::string & str, checkpoint & c);
+    checkpoint find(const std::string & str, size_type checkpoint::* field, size_type target) const;
+
+    size_type m_interval;
+    std::vector<checkpoint> m_checkpoints;
+    checkpoint m_end;
+};
+
+} // namespace miniutf
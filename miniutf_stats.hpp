@@ -0,0 +1,75 @@
+/* Copyright (c) 2013 Dropbox, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Internal instrumentation macros; see miniutf::stats in miniutf.hpp. Everything here compiles
+ * to nothing unless MINIUTF_STATS is defined.
+ */
+
+#pragma once
+
+#include "miniutf.hpp"
+
+namespace miniutf {
+
+#ifdef MINIUTF_STATS
+
+// The calling thread's counters.
+MINIUTF_INLINE stats & thread_stats();
+
+// Add n to the given counter.
+#define MINIUTF_STAT(counter, n) (::miniutf::thread_stats().counter += (n))
+
+// Count one allocation if buffer's capacity has changed by the end of the enclosing scope.
+// Use it in a scope that can grow the buffer at most once.
+#define MINIUTF_STAT_GROWTH(buffer) \
+    ::miniutf::growth_counter<decltype(buffer)> miniutf_growth_counter_(buffer)
+
+template <typename T>
+class growth_counter {
+public:
+    explicit growth_counter(const T & buffer) : m_buffer(buffer), m_capacity(buffer.capacity()) {}
+    ~growth_counter() {
+        if (m_buffer.capacity() != m_capacity)
+            thread_stats().allocations++;
+    }
+private:
+    const T & m_buffer;
+    const size_t m_capacity;
+};
+
+#else
+
+#define MINIUTF_STAT(counter, n) ((void)0)
+#define MINIUTF_STAT_GROWTH(buffer) ((void)0)
+
+#endif
+
+/*
+ * buffer.reserve(n), counting the allocation if there is one.
+ */
+template <typename T>
+inline void counted_reserve(T & buffer, size_t n) {
+    MINIUTF_STAT_GROWTH(buffer);
+    buffer.reserve(n);
+}
+
+} // namespace miniutf
@@ -23,6 +23,7 @@
 from collections import defaultdict, namedtuple
 import itertools
 import textwrap
+import struct
 import sys
 import os
 import re
@@ -101,6 +102,155 @@ def parse_collation(base_path):
     return collation_elements
 
 
+# Grapheme_Cluster_Break property values, numbered as in grapheme_break_property in miniutf.cpp.
+GRAPHEME_BREAK_PROPERTIES = [
+    "Other", "CR", "LF", "Control", "Extend", "Regional_Indicator", "Prepend", "SpacingMark",
+    "L", "V", "T", "LV", "LVT",
+]
+
+# Other_Grapheme_Extend, from PropList.txt.
+OTHER_GRAPHEME_EXTEND = [
+    (0x09BE, 0x09BE), (0x09D7, 0x09D7), (0x0B3E, 0x0B3E), (0x0B57, 0x0B57), (0x0BBE, 0x0BBE),
+    (0x0BD7, 0x0BD7), (0x0CC2, 0x0CC2), (0x0CD5, 0x0CD6), (0x0D3E, 0x0D3E), (0x0D57, 0x0D57),
+    (0x0DCF, 0x0DCF), (0x0DDF, 0x0DDF), (0x200C, 0x200D), (0x302E, 0x302F), (0xFF9E, 0xFF9F),
+    (0x1D165, 0x1D165), (0x1D16E, 0x1D172),
+]
+
+# Spacing marks that UAX #29 does not treat as SpacingMark.
+NOT_SPACING_MARK = [
+    (0x102B, 0x102C), (0x1038, 0x1038), (0x1062, 0x1064), (0x1067, 0x106D), (0x1083, 0x1083),
+    (0x1087, 0x108C), (0x108F, 0x108F), (0x109A, 0x109C), (0x1A61, 0x1A61), (0x1A63, 0x1A64),
+    (0xAA7B, 0xAA7B), (0xAA7D, 0xAA7D),
+]
+
+# Unassigned codepoints in these Default_Ignorable_Code_Point ranges are Control.
+DEFAULT_IGNORABLE_RESERVED = [ (0x2060, 0x206F), (0xFFF0, 0xFFF8), (0xE0000, 0xE0FFF) ]
+
+def parse_grapheme_break(base_path, data):
+    """Return the Grapheme_Cluster_Break property of every codepoint, as indexes into
+    GRAPHEME_BREAK_PROPERTIES.
+
+    This reads GraphemeBreakProperty.txt if it's there (fetch-property-data.sh downloads it),
+    and otherwise derives the property from UnicodeData.txt as described in table 2 of the
+    Unicode 6.3 version of UAX #29. test.cpp runs GraphemeBreakTest.txt against the result if
+    that's there too.
+    """
+    props = [ 0 ] * 0x110000
+    path = os.path.join(base_path, "GraphemeBreakProperty.txt")
+    if os.path.exists(path):
+        for line in file_lines(path):
+            codepoints, prop = [ field.strip() for field in line.split(";") ]
+            first, _, last = codepoints.partition("..")
+            for cp in xrange(from_hex(first), from_hex(last or first) + 1):
+                props[cp] = GRAPHEME_BREAK_PROPERTIES.index(prop)
+        return props
+
+    print >>sys.stderr, "%s is missing: deriving it from UnicodeData.txt" % path
+
+    def in_ranges(cp, ranges):
+        return any(lo <= cp <= hi for lo, hi in ranges)
+
+    prop_index = GRAPHEME_BREAK_PROPERTIES.index
+    for cp in xrange(0x110000):
+        info = data.get(cp)
+        category = info.category if info else None
+        if cp == 0x0D:
+            prop = "CR"
+        elif cp == 0x0A:
+            prop = "LF"
+        elif category in ("Mn", "Me") or in_ranges(cp, OTHER_GRAPHEME_EXTEND):
+            prop = "Extend"
+        elif category in ("Zl", "Zp", "Cc", "Cf") or 0xD800 <= cp <= 0xDFFF \
+                or (info is None and in_ranges(cp, DEFAULT_IGNORABLE_RESERVED)):
+            prop = "Control"
+        elif 0x1F1E6 <= cp <= 0x1F1FF:
+            prop = "Regional_Indicator"
+        elif (category == "Mc" and not in_ranges(cp, NOT_SPACING_MARK)) or cp in (0x0E33, 0x0EB3):
+            prop = "SpacingMark"
+        elif 0x1100 <= cp <= 0x115F or 0xA960 <= cp <= 0xA97C:
+            prop = "L"
+        elif 0x1160 <= cp <= 0x11A7 or 0xD7B0 <= cp <= 0xD7C6:
+            prop = "V"
+        elif 0x11A8 <= cp <= 0x11FF or 0xD7CB <= cp <= 0xD7FB:
+            prop = "T"
+        elif 0xAC00 <= cp <= 0xD7A3:
+            prop = "LV" if (cp - 0xAC00) % 28 == 0 else "LVT"
+        else:
+            prop = "Other"
+        props[cp] = prop_index(prop)
+    return props
+
+
+def parse_confusables(base_path):
+    """Return the prototype of every confusable codepoint, as a list of codepoints, from the
+    MA (mixed-script, any-case) table that UTS #39 skeletons use, or None if confusables.txt
+    isn't there.
+
+    confusables.txt is versioned separately, so take the one for Unicode 6.3.0;
+    fetch-security-data.sh downloads it. Without it the header has no confusable tables, and
+    skeleton can't be built (see MINIUTF_CONFUSABLES in miniutf.hpp).
+    """
+    path = os.path.join(base_path, "confusables.txt")
+    if not os.path.exists(path):
+        print >>sys.stderr, "%s is missing: leaving out the confusable tables" % path
+        return None
+
+    prototypes = {}
+    for line in file_lines(path):
+        fields = [ field.strip() for field in line.split(";") ]
+        # Skip anything that isn't a mapping, such as the byte order mark on the first line.
+        if len(fields) < 3 or fields[2] != "MA":
+            continue
+        prototypes[from_hex(fields[0])] = map(from_hex, fields[1].split())
+    return prototypes
+
+
+# Wide (W) and fullwidth (F) ranges from EastAsianWidth.txt for Unicode 6.3, for when it isn't
+# present (fetch-property-data.sh downloads it). These take in the unassigned codepoints of each
+# block, which also default to W. U+3248..U+324F, circled numbers on black squares, are
+# ambiguous (A), so they're left out. For every codepoint assigned in 6.3, these match the
+# W and F values of later versions, except for the emoji that Unicode 9.0 made wide.
+FALLBACK_WIDE = [
+    (0x1100, 0x115F), (0x2329, 0x232A), (0x2E80, 0x303E), (0x3041, 0x3247), (0x3250, 0x33FF),
+    (0x3400, 0x4DBF), (0x4E00, 0x9FFF), (0xA000, 0xA4CF), (0xA960, 0xA97F), (0xAC00, 0xD7A3),
+    (0xF900, 0xFAFF), (0xFE10, 0xFE19), (0xFE30, 0xFE6F), (0xFF00, 0xFF60), (0xFFE0, 0xFFE6),
+    (0x1B000, 0x1B0FF), (0x1F200, 0x1F2FF), (0x20000, 0x2FFFD), (0x30000, 0x3FFFD),
+]
+
+def parse_display_width(base_path, data):
+    """Return the number of terminal columns every codepoint takes up, as wcwidth would, XORed
+    with 1 so that the common width of 1 is stored as 0.
+
+    Marks (Mn, Me), format characters (Cf) other than the soft hyphen, controls and separators
+    (Cc, Zl, Zp), and Hangul medial vowels and final consonants, which join the syllable
+    before them, take no columns. Wide (W) and fullwidth (F) characters take two, read from
+    EastAsianWidth.txt if it's there, and otherwise from FALLBACK_WIDE. Everything else,
+    including ambiguous (A) characters, takes one.
+    """
+    widths = [ 1 ] * 0x110000
+    path = os.path.join(base_path, "EastAsianWidth.txt")
+    if os.path.exists(path):
+        for line in file_lines(path):
+            codepoints, prop = [ field.strip() for field in line.split(";") ]
+            if prop in ("W", "F"):
+                first, _, last = codepoints.partition("..")
+                for cp in xrange(from_hex(first), from_hex(last or first) + 1):
+                    widths[cp] = 2
+    else:
+        print >>sys.stderr, "%s is missing: using FALLBACK_WIDE" % path
+        for first, last in FALLBACK_WIDE:
+            for cp in xrange(first, last + 1):
+                widths[cp] = 2
+
+    for cp, info in data.iteritems():
+        if info.category in ("Mn", "Me", "Cf", "Cc", "Zl", "Zp") and cp != 0x00AD:
+            widths[cp] = 0
+    for cp in xrange(0x1160, 0x1200):
+        widths[cp] = 0
+
+    return [ width ^ 1 for width in widths ]
+
+
 def recursive_decompose(data, pt):
     """Return the full decomposition for codepoint pt.
     """
@@ -152,13 +302,171 @@ def split_array(arr):
     )
 
 
-def dump_table(name, data):
-    """Dump data as a C array called 'name'.
+# Lookup-speed layouts. The default tables above are as small as possible; the alternates
+# below (compiled in with -DMINIUTF_FAST_TRIES) are picked by a cost model that charges for
+# the dependent loads a lookup needs as well as for bytes. Lookups are weighted by how often
+# we expect to see each block in filenames and other short user-visible strings:
+TRIE_PROFILE = [
+    (0x0000, 0x0080, 0.70),     # ASCII
+    (0x0080, 0x0250, 0.08),     # Latin-1 Supplement, Latin Extended-A and -B
+    (0x0300, 0x0370, 0.02),     # Combining Diacritical Marks (NFD input)
+    (0x0370, 0x0530, 0.04),     # Greek, Cyrillic
+    (0x3000, 0x3100, 0.03),     # CJK punctuation, kana
+    (0x4E00, 0xA000, 0.08),     # CJK Unified Ideographs
+    (0xAC00, 0xD7A4, 0.03),     # Hangul syllables
+    (0x1F300, 0x1FA00, 0.02),   # Emoji
+]
+
+# How many bytes of table we'll spend to save one dependent load per (weighted) lookup. This
+# is set from the trie_lookup benchmark (make bench): lower values start picking 3-level
+# tries, which are smaller but measurably slower than the compact layout.
+TRIE_LOAD_COST = 65536
+
+# Fast tables are cache-line aligned, so each one costs a whole number of lines.
+TRIE_ALIGNMENT = 64
+
+# Candidate lengths for the directly indexed prefix of the table, chosen at block boundaries.
+TRIE_DIRECT_PREFIXES = (0, 0x80, 0x100, 0x180, 0x250, 0x370, 0x530)
+
+def aligned_size(data):
+    nbytes = bytes_needed(data)[1] * len(data)
+    return (nbytes + TRIE_ALIGNMENT - 1) // TRIE_ALIGNMENT * TRIE_ALIGNMENT
+
+def expected_loads(length, direct, levels):
+    """Profile-weighted number of table loads per lookup.
+
+    Codepoints below 'direct' take one load, codepoints past the end of the table none, and
+    everything else one per trie level.
+    """
+    total = 0.0
+    for lo, hi, weight in TRIE_PROFILE:
+        n_direct = max(0, min(hi, direct) - lo)
+        n_trie = max(0, min(hi, length) - max(lo, direct))
+        total += weight * float(n_direct + n_trie * levels) / (hi - lo)
+    return total
+
+def trie_candidates(arr):
+    """Yield (tables, shifts) for every 2- and 3-level split of arr worth considering.
+    """
+    for shift in xrange(2, 12):
+        t1, t2, _ = try_split(arr, shift)
+        yield (t1, t2), (shift, )
+        for shift1 in xrange(2, 9):
+            t0, t1b, _ = try_split(t1, shift1)
+            yield (t0, t1b, t2), (shift1, shift)
+
+def search_fast_layout(arr):
+    """Return (cost, direct, tables, shifts) for the cheapest layout of arr under the model.
+    """
+    tries = list(trie_candidates(arr))
+    best = None
+    for direct in TRIE_DIRECT_PREFIXES:
+        if direct >= len(arr):
+            break
+        direct_bytes = aligned_size(arr[:direct]) if direct else 0
+        for tables, shifts in tries:
+            # The trie still covers the direct prefix; those blocks are mostly shared with
+            # others, so this slightly overstates its size rather than rebuilding it.
+            nbytes = direct_bytes + sum(aligned_size(t) for t in tables)
+            cost = nbytes + TRIE_LOAD_COST * expected_loads(len(arr), direct, len(tables))
+            if best is None or cost < best[0]:
+                best = (cost, direct, tables, shifts)
+    return best
+
+def make_fast_lookup(name, arr):
+    """Emit the lookup-speed layout of arr as tables plus an accessor called 'name'.
+    """
+    cost, direct, tables, shifts = search_fast_layout(arr)
+
+    def lookup(cp):
+        if cp < direct:
+            return arr[cp]
+        if len(tables) == 2:
+            (t1, t2), (shift, ) = tables, shifts
+            return t2[(t1[cp >> shift] << shift) + (cp & ((1 << shift) - 1))]
+        (t1, t2, t3), (shift1, shift) = tables, shifts
+        i = (t2[(t1[cp >> (shift1 + shift)] << shift1) + ((cp >> shift) & ((1 << shift1) - 1))])
+        return t3[(i << shift) + (cp & ((1 << shift) - 1))]
+    assert all(lookup(cp) == v for cp, v in enumerate(arr))
+
+    nbytes, defs = 0, []
+    if direct:
+        defs.append(dump_table(name + "_direct", arr[:direct], aligned = True))
+    for level, table in enumerate(tables):
+        defs.append(dump_table("%s_t%d" % (name, level + 1), table, aligned = True))
+    nbytes = sum(b for b, d in defs)
+
+    if len(tables) == 2:
+        shift, = shifts
+        expr = "%s_t2[(%s_t1[codepoint >> %d] << %d) + (codepoint & %d)]" % (
+            name, name, shift, shift, (1 << shift) - 1)
+    else:
+        shift1, shift = shifts
+        expr = "%s_t3[(%s_t2[(%s_t1[codepoint >> %d] << %d) + ((codepoint >> %d) & %d)] << %d) + (codepoint & %d)]" % (
+            name, name, name, shift1 + shift, shift1, shift, (1 << shift1) - 1, shift, (1 << shift) - 1)
+
+    out = "\n".join(d for b, d in defs) + "\n"
+    out += "constexpr int32_t %s(int32_t codepoint) {\n" % name
+    if direct:
+        out += "    return codepoint < %d ? %s_direct[codepoint]\n" % (direct, name)
+        out += "         : codepoint >= %d ? 0\n" % len(arr)
+    else:
+        out += "    return codepoint >= %d ? 0\n" % len(arr)
+    out += "         : %s;\n}" % expr
+
+    print >>sys.stderr, "%s: fast layout: direct %d, %d levels, shifts %s, %d bytes, %.2f loads" % (
+        name, direct, len(tables), shifts, nbytes, expected_loads(len(arr), direct, len(tables)))
+    return nbytes, out
+
+def with_fast_layout(compact, fast):
+    """Combine the compact and fast versions of a table, selected at build time.
+    """
+    (compact_bytes, compact_defs), (fast_bytes, fast_defs) = compact, fast
+    return (compact_bytes, fast_bytes), "#ifdef MINIUTF_FAST_TRIES\n%s\n#else\n%s\n#endif" % (
+        fast_defs, compact_defs)
+
+
+def dump_table(name, data, aligned = False):
+    """Dump data as a C array called 'name', cache-line aligned if 'aligned' is set.
     """
     prefix, nbytes = bytes_needed(data)
     typ = "%sint%s_t" % (prefix, nbytes * 8)
-    return len(data) * nbytes, "static const %s %s[] = {\n    %s\n};\n" % (
-        typ, name, "\n    ".join(textwrap.wrap(", ".join(map(str, data)))))
+    align = "alignas(%d)" % TRIE_ALIGNMENT if aligned else ""
+    nbytes = aligned_size(data) if aligned else len(data) * nbytes
+    return nbytes, table_definition(align, typ, name, textwrap.wrap(", ".join(map(str, data))))
+
+def table_definition(align, typ, name, lines):
+    """The definition of a generated table, given the lines of its initializer.
+    """
+    return "MINIUTF_DATA_TABLE(%s, %s, %s) {\n    %s\n};\nMINIUTF_DATA_TABLE_END(%s, %s, %s)\n" % (
+        align, typ, name, "\n    ".join(lines), align, typ, name)
+
+def header_prologue(guard):
+    """Start a generated header: an include guard, and the macros that define its tables.
+
+    Each table has external linkage and a single definition however many translation units
+    include the header, so the constexpr lookups that read it are the same function
+    everywhere (which the one-definition rule requires of inline functions). In C++17 the
+    tables are inline variables. Before that, each one is the static member of a class
+    template, which the linker also merges, and the table's name is a reference to it.
+    """
+    return """#ifndef %s
+#define %s
+
+#ifndef MINIUTF_DATA_TABLE
+#if __cplusplus >= 201703L
+#define MINIUTF_DATA_TABLE(align, type, name) align inline constexpr type name[] =
+#define MINIUTF_DATA_TABLE_END(align, type, name)
+#else
+#define MINIUTF_DATA_TABLE(align, type, name) \\
+    template <typename = void> struct name##_table { align static constexpr type data[] =
+#define MINIUTF_DATA_TABLE_END(align, type, name) \\
+    }; \\
+    template <typename T> align constexpr type name##_table<T>::data[]; \\
+    static constexpr decltype(name##_table<>::data) & name = name##_table<>::data;
+#endif
+#endif
+""" % (guard, guard)
 
 
 
@@ -192,19 +500,22 @@ def make_translation_map(name, translation_func):
     t2b, t2 = dump_table(name + "_t2", index2)
 
     out = "%s\n%s\n%s\n" % (v, t1, t2)
-    out += """int32_t %s(int32_t codepoint) {
-        int offset_index;
-    if (codepoint >= %d) return 0;
-    offset_index = %s_t2[(%s_t1[codepoint >> %d] << %d) + (codepoint & %d)];
-    return %s_values[offset_index];
-}""" % (name, len(translation_map), name, name, shift, shift, (1 << shift) - 1, name)
+    out += """constexpr int32_t %s(int32_t codepoint) {
+    return codepoint >= %d ? 0
+         : %s_values[%s_t2[(%s_t1[codepoint >> %d] << %d) + (codepoint & %d)]];
+}""" % (name, len(translation_map), name, name, name, shift, shift, (1 << shift) - 1)
+
+    # The fast layout stores the values themselves rather than indexes into _values, which
+    # costs wider entries but saves a load.
+    fast = make_fast_lookup(name, [ value_table[i] for i in translation_map ])
 
-    return vb + t1b + t2b, out
+    return with_fast_layout((vb + t1b + t2b, out), fast)
 
 def make_direct_map(name, func):
-    out_map = [ func(data[codepoint]) if codepoint in data else 0
-                for codepoint in xrange(0x110000) ]
+    return make_direct_table(name, [ func(data[codepoint]) if codepoint in data else 0
+                                     for codepoint in xrange(0x110000) ])
 
+def make_direct_table(name, out_map):
     # End the table at the highest non-zero value
     out_map = out_map[:max(i for i, v in enumerate(out_map) if v) + 1]
 
@@ -214,20 +525,28 @@ def make_direct_map(name, func):
     t2b, t2 = dump_table(name + "_t2", index2)
 
     out = "%s\n%s\n" % (t1, t2)
-    out += """int32_t %s(int32_t codepoint) {
-    if (codepoint >= %d) return 0;
-    return %s_t2[(%s_t1[codepoint >> %d] << %d) + (codepoint & %d)];
+    out += """constexpr int32_t %s(int32_t codepoint) {
+    return codepoint >= %d ? 0
+         : %s_t2[(%s_t1[codepoint >> %d] << %d) + (codepoint & %d)];
 }""" % (name, len(out_map), name, name, shift, shift, (1 << shift) - 1)
 
-    return t1b + t2b, out
+    return with_fast_layout((t1b + t2b, out), make_fast_lookup(name, out_map))
 
 
-def make_collation_element_table(collation_elements):
+def build_collation_element_table(collation_elements):
 
     # The Default Unicode Collation Element Table (DUCET) is a mapping from sequences of
-    # codepoints to sequences of collation elements. We only implement "level 1" (see
-    # Unicode TR10 for more detail), so a collation element is the same as a "weight",
-    # a 16-bit integer. We use 32-bit integers throughout to represent weights.
+    # codepoints to sequences of collation elements. We implement levels 1 through 3 (see
+    # Unicode TR10 for more detail). A collation element has a 16-bit primary weight, a
+    # secondary weight that fits in 9 bits and a tertiary weight that fits in 5 bits, so
+    # we pack each element into one 32-bit integer:
+    #
+    # Bits 31:16    Primary (level 1) weight
+    # Bits 15:5     Secondary (level 2) weight
+    # Bits 4:0      Tertiary (level 3) weight
+    #
+    # Completely ignorable elements ([.0000.0000.0000]) contribute nothing at any level, so
+    # they are dropped.
     #
     # This function produces a hash table mapping sequences of codepoints to sequences of
     # collation elements. The actual collation algorithm is implmented in
@@ -256,20 +575,28 @@ def make_collation_element_table(collation_elements):
     #   and see if any key matches the input. Stop when a record indicating that it's the last
     #   is found.
 
-    def get_level_1_elements(elements):
-        return [el[0] for el in elements if el[0] != 0]
+    L2_SHIFT = 5
+    L1_SHIFT = 16
+
+    def pack_element(el):
+        assert el[0] < (1 << 16) and el[1] < (1 << (L1_SHIFT - L2_SHIFT)) \
+           and el[2] < (1 << L2_SHIFT)
+        return (el[0] << L1_SHIFT) | (el[1] << L2_SHIFT) | el[2]
 
-    level1_elements = { key: get_level_1_elements(all_levels)
+    def get_packed_elements(elements):
+        return [pack_element(el) for el in elements if any(el[:3])]
+
+    packed_elements = { key: get_packed_elements(all_levels)
                         for key, all_levels
                         in collation_elements.iteritems() }
 
     # How many bits do we need to store key and value lengths?
-    longest_key = max(len(key) for key in level1_elements.iterkeys())
-    longest_value = max(len(value) for value in level1_elements.itervalues())
+    longest_key = max(len(key) for key in packed_elements.iterkeys())
+    longest_value = max(len(value) for value in packed_elements.itervalues())
 
     KEY_BITS = longest_key.bit_length()
     VALUE_BITS = longest_value.bit_length()
-    BUCKETS = len(level1_elements)
+    BUCKETS = len(packed_elements)
     HASH_MULTIPLIER = 1031
     DUCET_DATA_HIGH_BIT = 31
 
@@ -281,7 +608,7 @@ def make_collation_element_table(collation_elements):
             out = (out * HASH_MULTIPLIER + i) % BUCKETS
         return out # % BUCKETS
 
-    for key, value in sorted(level1_elements.iteritems()):
+    for key, value in sorted(packed_elements.iteritems()):
         header_word = (len(key) << (DUCET_DATA_HIGH_BIT - KEY_BITS)) \
                     | (len(value) << (DUCET_DATA_HIGH_BIT - KEY_BITS - VALUE_BITS))
         assert (header_word & ~(~0 << UNICODE_CODE_SPACE_BITS)) == 0
@@ -319,20 +646,81 @@ def make_collation_element_table(collation_elements):
 
     assert len(data_array) == data_array_len
 
-    header = "// %r\n" % (collision_count, )
+    params = [ ("HASH_BUCKETS", BUCKETS),
+               ("HASH_MULTIPLIER", HASH_MULTIPLIER),
+               ("LONGEST_KEY", longest_key),
+               ("KEY_BITS", KEY_BITS),
+               ("VALUE_BITS", VALUE_BITS),
+               ("DATA_HIGH_BIT", DUCET_DATA_HIGH_BIT),
+               ("L1_SHIFT", L1_SHIFT),
+               ("L2_SHIFT", L2_SHIFT) ]
+
+    return data_array, bucket_to_offset, params, collision_count
+
+
+def make_collation_element_table(collation_elements):
+    """Dump the DUCET hash table as C arrays and #defines.
+    """
+    data_array, bucket_to_offset, params, collision_count = \
+        build_collation_element_table(collation_elements)
+
+    header = "// %r\n" % (collision_count, ) + header_prologue("MINIUTF_DATA_COLLATION_H") + "\n"
 
     dd_bytes, dd = dump_table("ducet_data", data_array)
     off_bytes, off = dump_table("ducet_bucket_indexes", bucket_to_offset)
-    footer = "#define DUCET_HASH_BUCKETS %d\n" % (BUCKETS, )
-    footer += "#define DUCET_HASH_MULTIPLIER %d\n" % (HASH_MULTIPLIER, )
-    footer += "#define DUCET_LONGEST_KEY %d\n" % (longest_key, )
-    footer += "#define DUCET_KEY_BITS %d\n" % (KEY_BITS, )
-    footer += "#define DUCET_VALUE_BITS %d\n" % (VALUE_BITS, )
-    footer += "#define DUCET_DATA_HIGH_BIT %d\n" % (DUCET_DATA_HIGH_BIT, )
+    footer = "".join("#define DUCET_%s %d\n" % param for param in params)
+    footer += "\n#endif\n"
 
     return dd_bytes + off_bytes, header + dd + off + footer
 
 
+COLLATION_BLOB_MAGIC = "miniutfC"
+COLLATION_BLOB_FORMAT = 1
+COLLATION_BLOB_UNICODE_VERSION = 0x060300
+
+def fnv1a(data):
+    """32-bit FNV-1a hash of a byte string; also implemented in miniutf_collation.cpp.
+    """
+    h = 0x811c9dc5
+    for c in data:
+        h = ((h ^ ord(c)) * 0x01000193) & 0xffffffff
+    return h
+
+def make_collation_blob(collation_elements):
+    """Serialize the DUCET hash table as a binary blob that miniutf can mmap at runtime
+    instead of compiling in miniutfdata_collation.h.
+
+    Everything is little-endian, and offsets are relative to the start of the blob, so it
+    can be mapped at any address. The layout is:
+
+        char     magic[8]              "miniutfC"
+        uint32   format version
+        uint32   Unicode version       0x00MMmmpp
+        uint32   checksum              FNV-1a of everything after the header
+        uint32   data length           number of words in ducet_data
+        uint32   bucket count          number of words in ducet_bucket_indexes
+        uint32   params[8]             the DUCET_* parameters, in the order below
+        uint32   ducet_data[]
+        uint32   ducet_bucket_indexes[]
+    """
+    data_array, bucket_to_offset, params, collision_count = \
+        build_collation_element_table(collation_elements)
+
+    assert [ name for name, value in params ] == [
+        "HASH_BUCKETS", "HASH_MULTIPLIER", "LONGEST_KEY", "KEY_BITS", "VALUE_BITS",
+        "DATA_HIGH_BIT", "L1_SHIFT", "L2_SHIFT" ]
+
+    payload = struct.pack("<%dI" % len(data_array), *data_array) \
+            + struct.pack("<%dI" % len(bucket_to_offset), *bucket_to_offset)
+
+    header = struct.pack("<8s13I", COLLATION_BLOB_MAGIC, COLLATION_BLOB_FORMAT,
+                         COLLATION_BLOB_UNICODE_VERSION, fnv1a(payload),
+                         len(data_array), len(bucket_to_offset),
+                         *[ value for name, value in params ])
+
+    return len(header) + len(payload), header + payload
+
+
 data, exclusions = parse_data("data-6.3.0")
 collation_elements = parse_collation("data-6.3.0")
 
@@ -355,6 +743,15 @@ composition_map = {
         and ccc.get(info.decomposition.mapping[0], 0) == 0
 }
 
+# Starters that a string can't be split in front of without changing its NFC form: those that
+# compose with what comes before them, or that decompose to something starting with one of
+# those or with a non-starter. (Hangul jamo are handled algorithmically, and aren't included.)
+backward_combining_starters = set(k2 for (k1, k2) in composition_map if ccc.get(k2, 0) == 0)
+unstable_starters = sorted(backward_combining_starters | set(
+    cp for cp, decomposition in decomposition_map.iteritems()
+    if ccc.get(cp, 0) == 0
+        and (ccc.get(decomposition[0], 0) != 0 or decomposition[0] in backward_combining_starters)))
+
 # Make a shorter list of all interesting codepoints
 interesting_codepoints = [0] + sorted(
       set(flatten([ cp ] + dc for cp, dc in decomposition_map.iteritems()))
@@ -377,11 +774,16 @@ for codepoint, decomposition in decomposition_map.iteritems():
 
     decomposition_starts[codepoint] = idx | ((len(decomposition) - 1) << 14)
 
+# unicode_compose in miniutf.cpp skips the lookup for anything below U+0300.
+assert min(k2 for (k1, k2) in composition_map) >= 0x300
+
 k2map = defaultdict(set)
 for (k1, k2), v in composition_map.iteritems():
     k2map[k1].add((k2, v))
 
-comp_seqs = []
+# comp_idx is 0 for codepoints that don't start any composition, so the first entry is a
+# placeholder that nothing refers to.
+comp_seqs = [0x8000, 0]
 comp_map = {}
 
 for k1, k2vs in k2map.iteritems():
@@ -394,9 +796,46 @@ for k1, k2vs in k2map.iteritems():
     comp_seqs.append(interesting_codepoint_map[last_k2] | 0x8000)
     comp_seqs.append(interesting_codepoint_map[last_v])
 
-if len(sys.argv) >= 2 and sys.argv[1] == "--collation":
+def make_confusable_tables(prototypes):
+    """Return the confusable_seq, confusable_idx and confusable_ascii tables for the given
+    prototypes, as from parse_confusables.
+
+    confusable_idx packs the start of each prototype in confusable_seq with its length in the
+    low 5 bits, so 0 means the codepoint isn't confusable. confusable_ascii is a bitmap of the
+    confusable ASCII characters, so that skeleton can check ASCII strings without the table
+    lookup.
+    """
+    sequences = [ 0 ]
+    starts = {}
+    sequence_cache = {}
+    for codepoint, prototype in sorted(prototypes.iteritems()):
+        key = tuple(prototype)
+        if key not in sequence_cache:
+            sequence_cache[key] = len(sequences)
+            sequences.extend(prototype)
+
+        assert 1 <= len(prototype) < 32
+        starts[codepoint] = (sequence_cache[key] << 5) | len(prototype)
+
+    ascii_bits = sum(1 << cp for cp in starts if cp < 0x80)
+    ascii_line = "0x%016xULL, 0x%016xULL" % (ascii_bits & 0xFFFFFFFFFFFFFFFF, ascii_bits >> 64)
+    return {
+        "confusable_seq": dump_table("confusable_seq", sequences),
+        "confusable_idx": make_direct_table("confusable_idx",
+            [ starts.get(cp, 0) for cp in xrange(0x110000) ]),
+        "confusable_ascii": (0, table_definition("", "uint64_t", "confusable_ascii",
+                                                 [ ascii_line ])
+                                + "\n#define MINIUTF_HAS_CONFUSABLE_DATA 1\n"),
+    }
+
+if len(sys.argv) >= 2 and sys.argv[1] == "--collation-blob":
+    nbytes, blob = make_collation_blob(collation_elements)
+    sys.stdout.write(blob)
+    print >>sys.stderr, "ducet blob: %d" % nbytes
+    sys.exit(0)
+elif len(sys.argv) >= 2 and sys.argv[1] == "--collation":
     out = {
-        "ducet_level1": make_collation_element_table(collation_elements)
+        "ducet": make_collation_element_table(collation_elements)
     }
 else:
     out = {
@@ -408,12 +847,38 @@ else:
         "decomp_idx": make_direct_map("decomp_idx", lambda info: decomposition_starts.get(info.codepoint, 0)),
         "comp_seq": dump_table("comp_seq", comp_seqs),
         "comp_idx": make_direct_map("comp_idx", lambda info: comp_map.get(info.codepoint, 0)),
+        "unstable_starters": dump_table("unstable_starters", unstable_starters),
+        "grapheme_break": make_direct_table("grapheme_break", parse_grapheme_break("data-6.3.0", data)),
+        "char_width": make_direct_table("char_width", parse_display_width("data-6.3.0", data)),
     }
+    confusables = parse_confusables("data-6.3.0")
+    if confusables is not None:
+        out.update(make_confusable_tables(confusables))
+
+if "ducet" not in out:
+    print header_prologue("MINIUTF_DATA_H")
 
 # for k in sorted(out.keys()):
 #     (nbytes, defs) = out[k]
 for k, (nbytes, defs) in out.iteritems():
     print defs
-    print >>sys.stderr, "%s: %d" % (k, nbytes)
-
-print >>sys.stderr, "total: %s" % sum(nbytes for nbytes, defs in out.values())
+    print >>sys.stderr, "%s: %s" % (k, nbytes)
+
+# Tables with a fast layout report (compact, fast) sizes; the rest are shared by both.
+compact_total = sum(nbytes[0] if isinstance(nbytes, tuple) else nbytes for nbytes, defs in out.values())
+fast_total = sum(nbytes[1] if isinstance(nbytes, tuple) else nbytes for nbytes, defs in out.values())
+
+if any(isinstance(nbytes, tuple) for nbytes, defs in out.values()):
+    print """#ifdef MINIUTF_FAST_TRIES
+#define MINIUTF_TRIE_LAYOUT "fast"
+#define MINIUTF_DATA_BYTES %d
+#else
+#define MINIUTF_TRIE_LAYOUT "compact"
+#define MINIUTF_DATA_BYTES %d
+#endif
+
+#endif
+""" % (fast_total, compact_total)
+    print >>sys.stderr, "total: %d (fast layout: %d)" % (compact_total, fast_total)
+else:
+    print >>sys.stderr, "total: %s" % compact_total
@@ -19,13 +19,18 @@
  * THE SOFTWARE.
  */
 
+#include <algorithm>
 #include <cstdio>
+#include <cstring>
 #include <fstream>
+#include <map>
+#include <memory>
 #include <sstream>
 #include <random>
 
 #include "miniutf.hpp"
 #include "miniutf_collation.hpp"
+#include "miniutf_index.hpp"
 
 using std::string;
 using std::istringstream;
@@ -133,6 +138,753 @@ bool check_match_key(const string & s1, const string & s2) {
     return true;
 }
 
+bool check_sort_key_order(const std::vector<string> & strings) {
+    for (size_t i = 1; i < strings.size(); i++) {
+        std::vector<uint32_t> k1 = miniutf::sort_key(strings[i-1]);
+        std::vector<uint32_t> k2 = miniutf::sort_key(strings[i]);
+        if (!(k1 < k2)) {
+            printf("sort_key(%s) < sort_key(%s) test failed\n",
+                   string_as_hex(strings[i-1]).c_str(), string_as_hex(strings[i]).c_str());
+            printf("  got %s and %s\n", match_key_as_hex(k1).c_str(), match_key_as_hex(k2).c_str());
+            return false;
+        }
+        if (miniutf::sort_key(strings[i], 1) != miniutf::match_key(strings[i])) {
+            printf("sort_key(%s, 1) != match_key\n", string_as_hex(strings[i]).c_str());
+            return false;
+        }
+    }
+    return true;
+}
+
+bool check_collation_find(const string & haystack, const string & needle,
+                          size_t pos, size_t expected_offset, size_t expected_length) {
+    auto found = miniutf::collation_find(haystack, needle, pos);
+    if (found.first != expected_offset || found.second != expected_length) {
+        printf("collation_find(%s, %s, %d) test failed\n",
+               haystack.c_str(), needle.c_str(), (int)pos);
+        printf("  got (%d, %d), expected (%d, %d)\n", (int)found.first, (int)found.second,
+               (int)expected_offset, (int)expected_length);
+        return false;
+    }
+    return true;
+}
+
+bool check_prefix_index() {
+    std::vector<string> names { u8"Résumé.pdf", u8"resume-old.pdf", u8"Results.xlsx",
+                                u8"README", u8"rêve", u8"Zoë.jpg", u8"zoe2.jpg" };
+    std::vector<std::pair<string, miniutf::prefix_index::value_type>> entries;
+    for (size_t i = 0; i < names.size(); i++)
+        entries.emplace_back(names[i], i);
+
+    miniutf::prefix_index index;
+    index.build(entries);
+    index.insert(u8"résumé (1).pdf", 7);
+
+    auto check = [&] (const miniutf::prefix_index & idx, const string & prefix,
+                      std::vector<miniutf::prefix_index::value_type> expected) {
+        auto got = idx.find_prefix(prefix);
+        std::sort(got.begin(), got.end());
+        if (got != expected) {
+            printf("prefix_index find_prefix(%s) test failed, got", prefix.c_str());
+            for (auto v : got) printf(" %d", (int)v);
+            printf("\n");
+            return false;
+        }
+        return true;
+    };
+
+    if (!check(index, u8"RESUM", { 0, 1, 7 })) return false;
+    if (!check(index, u8"re", { 0, 1, 2, 3, 4, 7 })) return false;
+    if (!check(index, u8"zoe", { 5, 6 })) return false;
+    if (!check(index, u8"x", {})) return false;
+    if (index.find_prefix(u8"", 3).size() != 3) {
+        printf("prefix_index limit test failed\n");
+        return false;
+    }
+
+    // Round trip through an image, then insert enough to force a merge.
+    std::string image = index.image();
+    std::vector<uint64_t> aligned((image.size() + 7) / 8);
+    std::memcpy(aligned.data(), image.data(), image.size());
+    miniutf::prefix_index attached;
+    if (!attached.attach(aligned.data(), image.size()) || attached.size() != 8
+        || attached.attach(aligned.data(), image.size() - 1)) {
+        printf("prefix_index attach test failed\n");
+        return false;
+    }
+
+    // An entry whose key runs past the end of the keys, or ends before the previous one's, is
+    // rejected. The header is 24 bytes, and each entry is 16: key end, value.
+    std::vector<uint64_t> past_end = aligned, backwards = aligned;
+    past_end[3 + 7 * 2] = 0x100000000ULL;
+    backwards[3 + 3 * 2] = 0;
+    if (attached.attach(past_end.data(), image.size())
+        || attached.attach(backwards.data(), image.size()) || attached.size() != 0) {
+        printf("prefix_index corrupt entry test failed\n");
+        return false;
+    }
+
+    attached.attach(aligned.data(), image.size());
+    for (int i = 0; i < 3000; i++)
+        attached.insert(u8"zz" + std::to_string(i), 100 + i);
+    if (!check(attached, u8"resume", { 0, 1, 7 }) || attached.size() != 3008
+        || attached.find_prefix(u8"ZZ2").size() != 1111) {
+        return false;
+    }
+
+    return true;
+}
+
+bool check_folded_name_index() {
+    miniutf::folded_name_index index;
+    index.build({ { u8"README", 0 }, { u8"Caf\u00E9", 1 }, { u8"notes.txt", 2 },
+                  { u8"readme", 3 }, { u8"Cafe\u0301", 4 }, { u8"CAF\u00C9", 5 },
+                  { u8"\u212Aelvin", 6 } });
+    index.insert(u8"kelvin", 7);
+    index.insert(u8"Readme", 8);
+
+    typedef std::vector<miniutf::folded_name_index::value_type> values;
+    if (index.find(u8"readme") != values({ 0, 3, 8 })
+        || index.find(u8"cAF\u00E9") != values({ 1, 4, 5 })
+        || index.find(u8"KELVIN") != values({ 6, 7 }) || index.find(u8"Notes.TXT") != values({ 2 })
+        || !index.find(u8"README.md").empty() || !index.find(u8"Caf").empty()
+        || index.collisions() != std::vector<values>({ { 0, 3, 8 }, { 1, 4, 5 }, { 6, 7 } })) {
+        printf("folded_name_index test failed\n");
+        return false;
+    }
+
+    // Enough random names to grow the table several times, checked against a map keyed by
+    // the folded name.
+    const std::vector<string> pieces { u8"a", u8"A", u8"\u00E9", u8"e\u0301", u8"\u00C9",
+                                       u8"\u212B", u8"\u00E5", u8"_", u8"\u03A3", u8"\u03C3" };
+    std::vector<std::pair<string, miniutf::folded_name_index::value_type>> entries;
+    std::map<string, values> expected;
+    uint32_t seed = 1;
+    for (int i = 0; i < 20000; i++) {
+        string name;
+        for (int n = 0; n < 2 + i % 5; n++) {
+            seed = seed * 1103515245 + 12345;
+            name += pieces[(seed >> 16) % pieces.size()];
+        }
+        entries.emplace_back(name, i);
+        expected[miniutf::lowercase(miniutf::nfc(name))].push_back(i);
+    }
+    index.build(entries);
+    size_t groups = 0;
+    for (const auto & e : expected) {
+        groups += e.second.size() > 1;
+        if (index.find(e.first) != e.second) {
+            printf("folded_name_index find(%s) test failed\n", e.first.c_str());
+            return false;
+        }
+    }
+    if (index.size() != entries.size() || index.collisions().size() != groups) {
+        printf("folded_name_index collisions test failed\n");
+        return false;
+    }
+
+    // Many copies of one name, which would take quadratic time if inserting walked the group.
+    const string copies[] = { u8"Caf\u00E9", u8"cafe\u0301", u8"CAF\u00C9" };
+    values all;
+    index = miniutf::folded_name_index();
+    index.insert(u8"other", 0);
+    for (int i = 1; i <= 100000; i++) {
+        index.insert(copies[i % 3], i);
+        all.push_back(i);
+    }
+    if (index.find(u8"caf\u00E9") != all || index.find(u8"other") != values({ 0 })
+            || index.collisions() != std::vector<values>({ all })) {
+        printf("folded_name_index repeated name test failed\n");
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Check count_codepoints, utf16_length and offset_index against decoding str one codepoint at
+ * a time.
+ */
+bool check_offsets(const string & str) {
+    // Where each byte, codepoint and UTF-16 code unit falls, by brute force.
+    std::vector<size_t> cp_byte, u16_byte, byte_cp(str.size()), byte_u16(str.size());
+    for (size_t pos = 0; pos < str.size(); ) {
+        const size_t start = pos;
+        const char32_t pt = miniutf::utf8_decode(str, pos);
+        for (size_t i = start; i < pos; i++) {
+            byte_cp[i] = cp_byte.size();
+            byte_u16[i] = u16_byte.size();
+        }
+        cp_byte.push_back(start);
+        u16_byte.insert(u16_byte.end(), pt >= 0x10000 ? 2 : 1, start);
+    }
+
+    const size_t codepoints = cp_byte.size(), utf16_length = u16_byte.size();
+    bool ok = miniutf::count_codepoints(str) == codepoints
+           && miniutf::utf16_length(str) == utf16_length;
+
+    // Each end maps to the other.
+    cp_byte.push_back(str.size());
+    u16_byte.push_back(str.size());
+    byte_cp.push_back(codepoints);
+    byte_u16.push_back(utf16_length);
+
+    for (size_t interval : { 1, 3, 64 }) {
+        miniutf::offset_index index(str, interval);
+        ok = ok && index.codepoints() == codepoints && index.utf16_length() == utf16_length;
+        for (size_t i = 0; i < cp_byte.size(); i++)
+            ok = ok && index.codepoint_to_byte(str, i) == cp_byte[i];
+        for (size_t i = 0; i < u16_byte.size(); i++)
+            ok = ok && index.utf16_to_byte(str, i) == u16_byte[i];
+        for (size_t i = 0; i < byte_cp.size(); i++) {
+            ok = ok && index.byte_to_codepoint(str, i) == byte_cp[i]
+                    && index.byte_to_utf16(str, i) == byte_u16[i];
+        }
+    }
+
+    if (!ok) {
+        printf("offsets test failed:");
+        dump(str);
+        printf("\n");
+    }
+    return ok;
+}
+
+bool check_stats() {
+    miniutf::stats_reset();
+    miniutf::match_key(u8"Ca\u0323\u0302fe\u0301");
+    miniutf::stats s = miniutf::stats_snapshot();
+
+#ifdef MINIUTF_STATS
+    bool ok = s.allocations > 0 && s.bytes_decoded == 10 && s.segments_normalized == 1
+           && s.ducet_probes > 0 && s.contraction_checks > 0;
+#else
+    bool ok = s.allocations == 0 && s.bytes_decoded == 0 && s.segments_normalized == 0
+           && s.ducet_probes == 0 && s.contraction_checks == 0;
+#endif
+
+    if (!ok) {
+        printf("stats test failed: %d %d %d %d %d\n", (int)s.allocations, (int)s.bytes_decoded,
+               (int)s.segments_normalized, (int)s.ducet_probes, (int)s.contraction_checks);
+    }
+    return ok;
+}
+
+bool check_utf16_bytes() {
+    using miniutf::byte_order;
+    const string str = u8"UTF-16 files from elsewhere: \u00E9\u65E5\U0001F4A9 and more ASCII";
+    const std::u16string units = miniutf::to_utf16(str);
+    bool ok = true;
+
+    for (byte_order order : { byte_order::little_endian, byte_order::big_endian }) {
+        string expected = order == byte_order::little_endian ? "\xFF\xFE" : "\xFE\xFF";
+        for (char16_t c : units) {
+            expected += char(order == byte_order::little_endian ? c & 0xFF : c >> 8);
+            expected += char(order == byte_order::little_endian ? c >> 8 : c & 0xFF);
+        }
+
+        const string bytes = miniutf::utf8_to_utf16_bytes(str, order, true);
+        byte_order detected = order == byte_order::little_endian ? byte_order::big_endian
+                                                                 : byte_order::little_endian;
+        const size_t bom = miniutf::utf16_detect_bom(bytes.data(), bytes.size(), detected);
+        bool replaced = false;
+        size_t error_offset = 0;
+        ok = ok && bytes == expected && bom == 2 && detected == order
+                && miniutf::utf16_bytes_to_utf8(bytes.data() + 2, bytes.size() - 2, order,
+                                                &replaced, &error_offset) == str
+                && !replaced && error_offset == string::npos
+                && miniutf::utf16_bytes_check(bytes.data(), bytes.size(), order);
+    }
+
+    // An unpaired surrogate, after eight bytes of ASCII, and then an odd byte.
+    const string bad("a\0b\0c\0d\0\0\xD8" "e\0f", 13);
+    bool replaced = false;
+    size_t error_offset = 0, check_offset = 0;
+    byte_order order = byte_order::big_endian;
+    ok = ok && miniutf::utf16_bytes_to_utf8(bad.data(), bad.size(), byte_order::little_endian,
+                                            &replaced, &error_offset)
+               == u8"abcd\uFFFDe\uFFFD"
+            && replaced && error_offset == 8
+            && !miniutf::utf16_bytes_check(bad.data(), bad.size(), byte_order::little_endian,
+                                           &check_offset)
+            && check_offset == 8
+            && miniutf::utf16_detect_bom(bad.data(), bad.size(), order) == 0
+            && order == byte_order::big_endian;
+
+    if (!ok)
+        printf("UTF-16 bytes test failed\n");
+    return ok;
+}
+
+bool check_single_byte() {
+    // Every byte value, with a run of ASCII long enough to take the word-at-a-time path.
+    string bytes = "ASCII text from elsewhere: ";
+    for (int b = 0x80; b < 0x100; b++)
+        bytes += char(b);
+
+    string latin1_expected = "ASCII text from elsewhere: ";
+    for (char32_t b = 0x80; b < 0x100; b++)
+        latin1_expected += miniutf::to_utf8(std::u32string(1, b));
+
+    bool replaced = false;
+    const string latin1 = miniutf::latin1_to_utf8(bytes);
+    bool ok = latin1 == latin1_expected
+            && miniutf::fits_latin1(latin1)
+            && miniutf::utf8_to_latin1(latin1, &replaced) == bytes && !replaced;
+
+    // 0x80 to 0x9F differ in Windows-1252, with the undefined 0x81 passed through as U+0081;
+    // the bytes from 0xA0 up are the same as Latin-1.
+    ok = ok && miniutf::cp1252_to_utf8("\x80 \x81 \x93quoted\x94 \x9F \xE9")
+                   == u8"\u20AC \u0081 \u201Cquoted\u201D \u0178 \u00E9"
+            && miniutf::cp1252_to_utf8(bytes.substr(27 + 32))
+                   == latin1_expected.substr(27 + 64);
+
+    ok = ok && !miniutf::fits_latin1(u8"ASCII text, then \u20AC")
+            && !miniutf::fits_latin1("ASCII text, then \xE9")
+            && !miniutf::fits_latin1("\xC3")
+            && miniutf::fits_latin1("")
+            && miniutf::utf8_to_latin1(u8"caf\u00E9 \u20AC5 \U0001F4A9", &replaced)
+                   == "caf\xE9 ?5 ?"
+            && replaced;
+
+    replaced = false;
+    ok = ok && miniutf::utf8_to_latin1("bad \xE9", &replaced) == "bad ?" && replaced;
+
+    if (!ok)
+        printf("single-byte encoding test failed\n");
+    return ok;
+}
+
+bool check_wtf8_cesu8() {
+    // Unpaired surrogates survive a round trip through WTF-8, and the pair is encoded as usual.
+    const std::u16string units = { 'a', 0xD800, 'b', 0xD83D, 0xDCA9, 0xDC00 };
+    const string wtf8 = "a\xED\xA0\x80" "b\xF0\x9F\x92\xA9\xED\xB0\x80";
+    bool ok = miniutf::utf16_to_wtf8(units) == wtf8
+            && miniutf::wtf8_to_utf16(wtf8) == units
+            && miniutf::to_utf8(units) == u8"a\uFFFDb\U0001F4A9\uFFFD";
+
+    // A NUL inside a run of ASCII, which Modified UTF-8 must not copy through.
+    const string utf8 = string(u8"ASCII\0text, \U0001F4A9 and \u00E9", 23);
+    const string cesu8 = string("ASCII\0text, \xED\xA0\xBD\xED\xB2\xA9 and \xC3\xA9", 25);
+    const string mutf8 = "ASCII\xC0\x80text, \xED\xA0\xBD\xED\xB2\xA9 and \xC3\xA9";
+    bool replaced = false;
+    ok = ok && miniutf::utf8_to_cesu8(utf8, &replaced) == cesu8
+            && miniutf::cesu8_to_utf8(cesu8, &replaced) == utf8
+            && miniutf::utf8_to_mutf8(utf8, &replaced) == mutf8
+            && miniutf::mutf8_to_utf8(mutf8, &replaced) == utf8
+            && !replaced;
+
+    // An unpaired surrogate isn't valid in the UTF-8 output.
+    ok = ok && miniutf::cesu8_to_utf8("\xED\xA0\xBDx\xED\xB2\xA9", &replaced)
+                   == u8"\uFFFDx\uFFFD"
+            && replaced;
+
+    if (!ok)
+        printf("WTF-8 / CESU-8 test failed\n");
+    return ok;
+}
+
+/*
+ * Check that iterating over range forwards and backwards finds the codepoints of expected.
+ */
+template <typename Range>
+bool check_codepoint_range(const char * name,
+                           const Range & range,
+                           const std::u32string & expected) {
+    std::u32string forward, backward;
+    std::vector<decltype(range.begin().base())> forward_pos, backward_pos;
+    for (auto it = range.begin(); it != range.end(); ++it) {
+        forward += *it;
+        forward_pos.push_back(it.base());
+    }
+    for (auto it = range.end(); it != range.begin(); ) {
+        backward += *--it;
+        backward_pos.push_back(it.base());
+    }
+    std::reverse(backward.begin(), backward.end());
+    std::reverse(backward_pos.begin(), backward_pos.end());
+
+    if (forward != expected || backward != expected || forward_pos != backward_pos) {
+        printf("%s iterator test failed\n", name);
+        return false;
+    }
+    return true;
+}
+
+bool check_iterators() {
+    // Every length, an invalid continuation byte, an overlong encoding, and a truncated
+    // sequence at the end of a buffer that isn't NUL-terminated.
+    const string str = u8"a\u00E9\u65E5\U0001F4A9" "\x80" "b\xC0\xAF" "c\xF0\x9F\x92!";
+    const string buffer = str + "\x80";
+    const std::u32string expected =
+        U"a\u00E9\u65E5\U0001F4A9\uFFFDb\uFFFD\uFFFDc\uFFFD\uFFFD\uFFFD!";
+    if (!check_codepoint_range("UTF-8", miniutf::codepoints(str), expected)
+            || !check_codepoint_range("UTF-8 buffer", miniutf::codepoints(buffer.data(), 5),
+                                      U"a\u00E9\uFFFD\uFFFD")) {
+        return false;
+    }
+
+    const std::u16string units = { 'a', 0xD83D, 0xDCA9, 0xDC00, 0xD800, 0xD800, 0xDC00, 'b' };
+    if (!check_codepoint_range("UTF-16", miniutf::codepoints(units),
+                               U"a\U0001F4A9\uFFFD\uFFFD\U00010000b")
+            || !check_codepoint_range("UTF-16 buffer", miniutf::codepoints(units.data(), 2),
+                                      U"a\uFFFD")) {
+        return false;
+    }
+
+    // Random bytes and random UTF-16, mostly invalid: stepping backward must find the same
+    // codepoints at the same places as stepping forward, and as to_utf32.
+    std::mt19937 gen; // note: unseeded - so this is deterministic
+    std::uniform_int_distribution<> len (0, 12);
+    std::discrete_distribution<> byte_class { 3, 4, 1, 2, 2, 1 };
+    const int byte_ranges[][2] = {
+        { 0x00, 0x7F }, { 0x80, 0xBF }, { 0xC0, 0xC1 }, { 0xC2, 0xDF }, { 0xE0, 0xEF },
+        { 0xF0, 0xFF },
+    };
+    std::discrete_distribution<> unit_class { 2, 2, 2, 1 };
+    const int unit_ranges[][2] = {
+        { 0x0000, 0x007F }, { 0xD800, 0xDBFF }, { 0xDC00, 0xDFFF }, { 0x0080, 0xFFFF },
+    };
+    for (int i = 0; i < 20000; i++) {
+        string bytes;
+        std::u16string random_units;
+        for (int n = len(gen); n > 0; n--) {
+            const int * b = byte_ranges[byte_class(gen)];
+            bytes += static_cast<char>(std::uniform_int_distribution<>(b[0], b[1])(gen));
+            const int * u = unit_ranges[unit_class(gen)];
+            random_units += static_cast<char16_t>(std::uniform_int_distribution<>(u[0], u[1])(gen));
+        }
+        if (!check_codepoint_range("random UTF-8", miniutf::codepoints(bytes),
+                                   miniutf::to_utf32(bytes))
+                || !check_codepoint_range("random UTF-16", miniutf::codepoints(random_units),
+                                          miniutf::to_utf32(miniutf::to_utf8(random_units)))) {
+            dump(bytes);
+            printf("\n");
+            return false;
+        }
+    }
+
+    // A reverse scan for the last '/', as for a file extension or suffix match.
+    const string path = u8"d\u00EFr/f\u00EFl\u00E9.txt";
+    const auto r = miniutf::codepoints(path);
+    typedef std::reverse_iterator<miniutf::utf8_iterator> reverse;
+    const auto slash = std::find(reverse(r.end()), reverse(r.begin()), U'/');
+    if (slash.base().base() - path.data() != 5) {
+        printf("reverse iterator test failed\n");
+        return false;
+    }
+    return true;
+}
+
+bool check_paths() {
+    using miniutf::path_form;
+    using miniutf::normalize_path;
+    const std::vector<string> paths = {
+        "ascii/only.txt",
+        u8"Cafe\u0301/r\u00E9sum\u00E9.txt",
+        u8"/a\u0301//\u0301b/",
+        u8"\u2126/\uF900\u00E9/x",
+        "",
+    };
+
+    // NFC and NFD give the same results as for the whole path.
+    bool ok = true;
+    for (const string & path : paths) {
+        ok = ok && normalize_path(path, path_form::nfc) == miniutf::nfc(path)
+                && normalize_path(path, path_form::nfd) == miniutf::nfd(path);
+    }
+
+    // Random paths, with combining marks at the start and end of components and on either
+    // side of precomposed characters, Hangul and singletons.
+    const std::vector<string> pieces = {
+        "/", "/", "a", "e", "x", ".", u8"\u0301", u8"\u0323", u8"\u0327", u8"\u031B",
+        u8"\u00E9", u8"\u00C5", u8"\u01D6", u8"\u1E69", u8"\uAC00", u8"\u1100", u8"\u1161",
+        u8"\u11A8", u8"\u2126", u8"\uF900", u8"\u0F73", u8"\U0001D15E",
+    };
+    std::mt19937 gen; // note: unseeded - so this is deterministic
+    std::uniform_int_distribution<> piece (0, int(pieces.size()) - 1);
+    std::uniform_int_distribution<> len (0, 10);
+    for (int i = 0; ok && i < 20000; i++) {
+        string path;
+        for (int n = len(gen); n > 0; n--)
+            path += pieces[piece(gen)];
+        ok = normalize_path(path, path_form::nfc) == miniutf::nfc(path)
+                && normalize_path(path, path_form::nfd) == miniutf::nfd(path);
+        if (!ok)
+            dump(path);
+    }
+
+    // HFS+ doesn't decompose the Ohm sign or CJK compatibility ideographs.
+    ok = ok && normalize_path(paths[3], path_form::hfs) == u8"\u2126/\uF900e\u0301/x"
+            && normalize_path(paths[3], path_form::nfd) == u8"\u03A9/\u8C48e\u0301/x"
+            && normalize_path(paths[1], path_form::hfs) == miniutf::nfd(paths[1]);
+
+    bool replaced = false;
+    ok = ok && normalize_path("ok/bad\xFF/ok", path_form::nfc, &replaced) == u8"ok/bad\uFFFD/ok"
+            && replaced;
+
+    miniutf::normalized_batch batch;
+    miniutf::normalize_paths(paths, path_form::hfs, batch);
+    ok = ok && batch.offsets.size() == paths.size() + 1;
+    for (size_t i = 0; ok && i < paths.size(); i++) {
+        ok = batch.data.substr(batch.offsets[i], batch.offsets[i + 1] - batch.offsets[i])
+                == normalize_path(paths[i], path_form::hfs);
+    }
+
+    if (!ok)
+        printf("path normalization test failed\n");
+    return ok;
+}
+
+#ifdef MINIUTF_CONFUSABLES
+bool check_skeleton() {
+    using miniutf::skeleton;
+
+    // Pairs that look alike, and pairs that don't.
+    const std::vector<std::pair<string, string>> confusable = {
+        { u8"p\u0430yp\u0430l", u8"paypal" },
+        { u8"\u0421\u041E\u0420\u0423", u8"COPY" },
+        { u8"\u039A\u039F\u039D\u0391", u8"KONA" },
+        { u8"\uFB01le.txt", u8"file.txt" },
+        { u8"chapter \u2163", u8"chapter IV" },
+        { u8"F1LE0", u8"FILEO" },
+        { u8"\u00E9t\u00E9", u8"e\u0301te\u0301" },
+    };
+    const std::vector<std::pair<string, string>> distinct = {
+        { u8"Caf\u00E9", u8"Cafe" },
+        { u8"paypal", u8"PAYPAL" },
+        { u8"\u0411", u8"B" },
+    };
+
+    bool ok = true;
+    for (const auto & p : confusable)
+        ok = ok && skeleton(p.first) == skeleton(p.second);
+    for (const auto & p : distinct)
+        ok = ok && skeleton(p.first) != skeleton(p.second);
+
+    // Skeletons are NFD, and the ASCII path copies.
+    ok = ok && skeleton(u8"\u00E9") == u8"e\u0301" && skeleton("report.txt") == "report.txt"
+            && skeleton(u8"\u0440\u00E9") == u8"pe\u0301" && skeleton(u8"1\u00E9") == u8"le\u0301"
+            && skeleton("") == "";
+
+    bool replaced = false;
+    ok = ok && skeleton("\xFFok", &replaced) == u8"\uFFFDok" && replaced;
+
+    if (!ok)
+        printf("skeleton test failed\n");
+    return ok;
+}
+#else
+bool check_skeleton() {
+    printf("/!\\ Skipping skeleton test.\n");
+    printf("    skeleton needs MINIUTF_CONFUSABLES and data-6.3.0/confusables.txt.\n");
+    printf("    To fetch it, cd into data-6.3.0/ and run fetch-security-data.sh,\n");
+    printf("    then regenerate miniutfdata.h\n");
+    return true;
+}
+#endif
+
+/*
+ * Check the context forms of nfc, nfd, lowercase and match_key against the plain ones, and
+ * that going over the same strings again allocates nothing.
+ */
+bool check_context() {
+    const string strings[] = {
+        u8"Cre\u0300me BRU\u0302LE\u0301E", u8"\u00C5ngstr\u00F6m", u8"",
+        u8"\u0418\u0323\u0306 \u1E0B\u0323 a\u0301\u0323\u0302\u0316\u0307",
+        string("bad \xFF byte"),
+    };
+
+    miniutf::context ctx;
+    std::vector<miniutf::byte_range> ranges, expected_ranges;
+    bool ok = true;
+    for (const string & str : strings) {
+        ok = ok && miniutf::nfc(str, ctx) == miniutf::nfc(str)
+                && miniutf::nfd(str, ctx) == miniutf::nfd(str)
+                && miniutf::lowercase(str, ctx) == miniutf::lowercase(str)
+                && miniutf::match_key(str, ctx) == miniutf::match_key(str)
+                && miniutf::match_key(str, ctx, &ranges)
+                   == miniutf::match_key(str, &expected_ranges)
+                && ranges == expected_ranges;
+
+        // A result can be passed back in with the same context.
+        ok = ok && miniutf::lowercase(miniutf::nfc(str, ctx), ctx)
+                   == miniutf::lowercase(miniutf::nfc(str))
+                && miniutf::nfc(miniutf::nfd(str, ctx), ctx) == miniutf::nfc(str)
+                && miniutf::nfd(miniutf::lowercase(str, ctx), ctx)
+                   == miniutf::nfd(miniutf::lowercase(str))
+                && miniutf::match_key(miniutf::nfc(str, ctx), ctx) == miniutf::match_key(str);
+    }
+
+    // Now that the buffers have grown, again, without the plain forms. (Allocations are only
+    // counted in MINIUTF_STATS builds.)
+    miniutf::stats_reset();
+    for (const string & str : strings) {
+        miniutf::nfc(str, ctx);
+        miniutf::nfd(str, ctx);
+        miniutf::lowercase(str, ctx);
+        miniutf::lowercase(miniutf::nfc(str, ctx), ctx);
+        miniutf::match_key(str, ctx, &ranges);
+    }
+    ok = ok && miniutf::stats_snapshot().allocations == 0;
+
+    if (!ok)
+        printf("context test failed\n");
+    return ok;
+}
+
+/*
+ * An allocator that counts the bytes it hands out, to check that the allocator-aware
+ * conversions use the allocator they're given.
+ */
+template <typename T>
+struct counting_allocator {
+    typedef T value_type;
+
+    explicit counting_allocator(size_t * bytes) : bytes(bytes) {}
+    template <typename U>
+    counting_allocator(const counting_allocator<U> & other) : bytes(other.bytes) {}
+
+    T * allocate(size_t n) {
+        *bytes += n * sizeof(T);
+        return std::allocator<T>().allocate(n);
+    }
+    void deallocate(T * p, size_t n) { std::allocator<T>().deallocate(p, n); }
+
+    size_t * bytes;
+};
+
+template <typename T, typename U>
+bool operator==(const counting_allocator<T> & a, const counting_allocator<U> & b) {
+    return a.bytes == b.bytes;
+}
+
+template <typename T, typename U>
+bool operator!=(const counting_allocator<T> & a, const counting_allocator<U> & b) {
+    return a.bytes != b.bytes;
+}
+
+bool check_allocator_variants() {
+    const string str = u8"\u00C5ngstr\u00F6m E\u0301COLE \u01C4 \U0001F4A9 \u1E0B\u0323";
+    const std::u16string str16 = miniutf::to_utf16(str);
+    const std::u32string str32 = miniutf::to_utf32(str);
+
+    size_t bytes = 0;
+    miniutf::basic_utf8_string<counting_allocator<char>> out8 { counting_allocator<char>(&bytes) };
+    miniutf::basic_utf16_string<counting_allocator<char16_t>> out16 {
+        counting_allocator<char16_t>(&bytes) };
+    miniutf::basic_utf32_string<counting_allocator<char32_t>> out32 {
+        counting_allocator<char32_t>(&bytes) };
+
+    // Each appends to what's already there.
+    miniutf::nfc(str, out8);
+    miniutf::nfd(str, out8);
+    miniutf::lowercase(str, out8);
+    miniutf::to_utf8(str16, out8);
+    miniutf::to_utf8(str32, out8);
+    miniutf::to_utf16(str, out16);
+    miniutf::to_utf32(str, out32);
+
+    bool ok = bytes >= out8.size() + out16.size() * 2 + out32.size() * 4
+           && string(out8.begin(), out8.end()) == miniutf::nfc(str) + miniutf::nfd(str)
+                                                  + miniutf::lowercase(str) + str + str
+           && std::u16string(out16.begin(), out16.end()) == str16
+           && std::u32string(out32.begin(), out32.end()) == str32;
+
+#ifdef MINIUTF_HAS_PMR
+    // Everything comes from the arena, whose upstream resource refuses to allocate.
+    char arena[1024];
+    std::pmr::monotonic_buffer_resource resource(arena, sizeof(arena),
+                                                 std::pmr::null_memory_resource());
+    ok = ok && miniutf::nfc_pmr(str, &resource) == miniutf::nfc(str).c_str()
+            && miniutf::lowercase_pmr(str, &resource) == miniutf::lowercase(str).c_str()
+            && miniutf::to_utf16_pmr(str, &resource) == str16.c_str()
+            && miniutf::nfc(str, nullptr) == miniutf::nfc(str)
+            && miniutf::nfd(str, nullptr) == miniutf::nfd(str);
+#endif
+
+    // A string longer than the scratch buffer limit doesn't leave the buffer that large.
+    miniutf::basic_utf8_string<counting_allocator<char>> long_out {
+        counting_allocator<char>(&bytes) };
+    miniutf::nfc(string(miniutf::normalize_scratch_limit * 2, 'a'), long_out);
+    ok = ok && long_out.size() == miniutf::normalize_scratch_limit * 2
+            && miniutf::normalize_scratch().capacity() <= miniutf::normalize_scratch_limit;
+
+    if (!ok)
+        printf("allocator variants test failed\n");
+    return ok;
+}
+
+/*
+ * Check that grapheme_next and grapheme_prev both find exactly the given cluster boundaries
+ * (besides 0 and str.size()).
+ */
+bool check_grapheme_breaks(const string & str, const std::vector<size_t> & expected) {
+    std::vector<size_t> forward, backward;
+    for (size_t pos = miniutf::grapheme_next(str, 0); pos < str.size();
+         pos = miniutf::grapheme_next(str, pos))
+        forward.push_back(pos);
+    for (size_t pos = miniutf::grapheme_prev(str, str.size()); pos > 0;
+         pos = miniutf::grapheme_prev(str, pos))
+        backward.insert(backward.begin(), pos);
+
+    if (forward != expected || backward != expected) {
+        printf("grapheme break test failed:");
+        dump(str);
+        printf("\n");
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Run the conformance tests in GraphemeBreakTest.txt, if it's there. Each line is a sequence
+ * of codepoints in hex, each one preceded by U+00F7 (a boundary) or U+00D7 (no boundary).
+ */
+bool check_grapheme_break_test() {
+    std::ifstream file("data-6.3.0/GraphemeBreakTest.txt");
+
+    if (!file) {
+        printf("/!\\ Skipping grapheme break conformance test.\n");
+        printf("    To fetch GraphemeBreakTest.txt, cd into data-6.3.0/ and run\n");
+        printf("    fetch-property-data.sh\n");
+        return true;
+    }
+
+    const string boundary = u8"\u00F7", no_boundary = u8"\u00D7";
+    string line;
+    int tests = 0;
+    while (std::getline(file, line)) {
+        line = line.substr(0, line.find('#'));
+        istringstream ss(line);
+        string token, str;
+        std::vector<size_t> expected;
+        bool surrogate = false;
+        while (ss >> token) {
+            if (token == boundary) {
+                if (!str.empty())
+                    expected.push_back(str.size());
+            } else if (token != no_boundary) {
+                const unsigned long pt = std::stoul(token, nullptr, 16);
+                surrogate = surrogate || (pt >= 0xD800 && pt <= 0xDFFF);
+                miniutf::utf8_encode(static_cast<char32_t>(pt), str);
+            }
+        }
+
+        // Lone surrogates can't be put in UTF-8; the boundary at the end is implied.
+        if (str.empty() || surrogate)
+            continue;
+        expected.pop_back();
+        if (!check_grapheme_breaks(str, expected)) {
+            printf("    %s\n", line.c_str());
+            return false;
+        }
+        tests++;
+    }
+
+    printf("Grapheme break conformance OK (%d tests)\n", tests);
+    return true;
+}
+
 bool check_collation_order() {
     std::ifstream file("data-6.3.0/CollationTest/CollationTest_NON_IGNORABLE.txt");
 
@@ -155,7 +907,7 @@ bool check_collation_order() {
         }
 
         string s = decode_hex(line.substr(0, semicolon));
-        std::vector<uint32_t> key = miniutf::match_key(s);
+        std::vector<uint32_t> key = miniutf::sort_key(s);
 
         if (key < last_match_key) {
             printf("Out of sequence, line %d:\n", i);
@@ -176,8 +928,54 @@ bool check_collation_order() {
     return true;
 }
 
+#ifdef MINIUTF_EXTERNAL_COLLATION_DATA
+/*
+ * Check that load_collation_data refuses blobs whose records would make lookups read past the
+ * table, and keeps the blob that's already loaded. Words 0 to 14 of a blob are the header;
+ * word 5 is the data length and words 10 to 14 are the key and value widths and shifts.
+ */
+bool check_collation_blob() {
+    std::ifstream file("miniutfdata_collation.bin", std::ios::binary | std::ios::ate);
+    std::vector<uint32_t> blob(static_cast<size_t>(file.tellg()) / 4);
+    file.seekg(0);
+    file.read(reinterpret_cast<char *>(blob.data()), blob.size() * 4);
+    const size_t header_words = 15;
+    const uint32_t data_len = blob[5];
+
+    // Drop the last word of the data, so that the last record runs past the end.
+    std::vector<uint32_t> truncated(blob.begin(), blob.begin() + header_words + data_len - 1);
+    truncated[5] = data_len - 1;
+    for (size_t i = header_words + data_len; i < blob.size(); i++)
+        truncated.push_back(std::min(blob[i], data_len - 1));
+
+    // Key lengths wider than the space left above the codepoint.
+    std::vector<uint32_t> bad_widths = blob;
+    bad_widths[10] = 12;
+
+    if (miniutf::load_collation_data(truncated.data(), truncated.size() * 4)
+        || miniutf::load_collation_data(bad_widths.data(), bad_widths.size() * 4)
+        || !miniutf::verify_collation_data()
+        || !miniutf::load_collation_data(blob.data(), blob.size() * 4)
+        || miniutf::match_key("A") != miniutf::match_key("a")) {
+        printf("collation blob test failed\n");
+        return false;
+    }
+    return miniutf::load_collation_data_file("miniutfdata_collation.bin");
+}
+#endif
+
 int main(void) {
 
+#ifdef MINIUTF_EXTERNAL_COLLATION_DATA
+    if (!miniutf::load_collation_data_file("miniutfdata_collation.bin")
+        || !miniutf::verify_collation_data()) {
+        printf("Couldn't load miniutfdata_collation.bin\n");
+        return 1;
+    }
+    if (!check_collation_blob())
+        return 1;
+#endif
+
     string utf8_test = { '\x61', '\x00', '\xF0', '\x9F', '\x92', '\xA9' };
     std::u16string utf16_test = { 0x61, 0, 0xD83D, 0xDCA9 };
 
@@ -194,12 +992,248 @@ int main(void) {
         return 1;
     }
 
+    // UTF-32 is checked and sized in blocks, so put the bad codepoints past the first one.
+    {
+        std::u32string utf32(100, U'a');
+        utf32 += U"\u00E9\u65E5\U0001F4A9";
+        utf32 += char32_t(0xD800);
+        const string expected = string(100, 'a') + u8"\u00E9\u65E5\U0001F4A9\xED\xA0\x80";
+        bool ok = miniutf::utf32_check(utf32) && miniutf::to_utf8(utf32) == expected;
+        utf32[70] = 0x110000;
+        utf32.back() = 0xFFFFFFFF;
+        ok = ok && !miniutf::utf32_check(utf32)
+                && miniutf::to_utf8(utf32) == string(70, 'a') + u8"\uFFFD" + string(29, 'a')
+                                              + u8"\u00E9\u65E5\U0001F4A9\uFFFD";
+        if (!ok) {
+            printf("UTF-32 test failed\n");
+            return 1;
+        }
+    }
+
+    if (!check_utf16_bytes())
+        return 1;
+
+    if (!check_single_byte())
+        return 1;
+
+    if (!check_wtf8_cesu8())
+        return 1;
+
+    if (!check_iterators())
+        return 1;
+
+    if (!check_paths())
+        return 1;
+
+    if (!check_skeleton())
+        return 1;
+
+    // U+1025 U+102E is the first composition in the table; nothing else composes with U+102E.
+    if (!check_eq("NFC(1025 102E)", u8"\u1026", miniutf::nfc(u8"\u1025\u102E"))) return 1;
+    if (!check_eq("NFC(35 102E)", u8"5\u102E", miniutf::nfc(u8"5\u102E"))) return 1;
+
     // Test match_key function
     if (!check_match_key(u8"Øǣç",
                          u8"oaec")) { return 1; }
     if (!check_match_key(u8"ãäåèéêëüõñ",
                          u8"aaaeeeeuon")) { return 1; }
 
+    // Test sort_key function
+    if (!check_sort_key_order({ u8"a", u8"A", u8"á", u8"Á", u8"ab", u8"b", u8"ss", u8"ß" })) {
+        return 1;
+    }
+    if (!check_sort_key_order({ u8"cote", u8"coté", u8"côte", u8"côté", u8"Côté" })) {
+        return 1;
+    }
+
+    // Test collation_find function
+    const size_t npos = string::npos;
+    if (!check_collation_find(u8"Crème brûlée", u8"BRULEE", 0, 7, 8)) return 1;
+    if (!check_collation_find(u8"Cre\u0300me bru\u0302le\u0301e", u8"crème", 0, 0, 7)) return 1;
+    if (!check_collation_find(u8"Cre\u0300me bru\u0302le\u0301e", u8"brûlée", 0, 8, 10)) return 1;
+    if (!check_collation_find(u8"résumé, Résumé", u8"resume", 1, 10, 8)) return 1;
+    if (!check_collation_find(u8"résumé", u8"resumes", 0, npos, 0)) return 1;
+    if (!check_collation_find(u8"abc", u8"", 2, 2, 0)) return 1;
+    if (!check_collation_find(u8"Straße", u8"s", 1, 4, 2)) return 1;
+
+    // Test the ranges output of match_key
+    {
+        typedef std::vector<miniutf::byte_range> ranges;
+        ranges got;
+        std::vector<uint32_t> key = miniutf::match_key(u8"æe\u0301\u0418\u0323\u0306b", &got);
+        ranges expected { { 0, 2 }, { 0, 2 }, { 2, 5 }, { 5, 11 }, { 11, 12 } };
+        if (key != miniutf::match_key(u8"aeeйb") || got != expected) {
+            printf("match_key ranges test failed\n");
+            return 1;
+        }
+    }
+
+    // Test grapheme cluster boundaries
+    if (!check_grapheme_breaks(u8"abc", { 1, 2 })) return 1;
+    if (!check_grapheme_breaks(u8"a\r\nb\n\r", { 1, 3, 4, 5 })) return 1;
+    if (!check_grapheme_breaks(u8"e\u0301\u0323x", { 5 })) return 1;
+    if (!check_grapheme_breaks(u8"\u0915\u094D\u0937\u093F", { 6 })) return 1;
+    if (!check_grapheme_breaks(u8"\u1100\u1161\u11A8\uAC00\u11A8", { 9 })) return 1;
+    if (!check_grapheme_breaks(u8"\U0001F1EB\U0001F1F7!\U0001F1E9", { 8, 9 })) return 1;
+    if (!check_grapheme_breaks(u8"\u0301a\u200D\u0007b", { 2, 6, 7 })) return 1;
+    if (!check_grapheme_breaks(string("a\xCC\x81\xCCz\x80", 6), { 3, 4, 5 })) return 1;
+    if (!check_grapheme_breaks(u8"", {})) return 1;
+    if (!check_grapheme_break_test()) return 1;
+
+    // Test truncate_utf8
+    {
+        using miniutf::truncate_utf8;
+        using miniutf::truncate_mode;
+        const string s = u8"ab\u00E9e\u0301\u0323\U0001F1EB\U0001F1F7";
+        const struct { size_t max_bytes; truncate_mode mode; size_t expected; } cases[] = {
+            { 100, truncate_mode::codepoint, s.size() },
+            { 3,  truncate_mode::codepoint, 2 },
+            { 4,  truncate_mode::codepoint, 4 },
+            { 6,  truncate_mode::codepoint, 5 },
+            { 7,  truncate_mode::codepoint, 7 },
+            { 7,  truncate_mode::grapheme, 4 },
+            { 9,  truncate_mode::grapheme, 9 },
+            { 15, truncate_mode::grapheme, 9 },
+            { 7,  truncate_mode::nfc_stable, 4 },
+            { 4,  truncate_mode::nfc_stable, 4 },
+            { 0,  truncate_mode::grapheme, 0 },
+        };
+        for (const auto & c : cases) {
+            if (truncate_utf8(s, c.max_bytes, c.mode) != c.expected) {
+                printf("truncate_utf8(%d, %d) test failed\n", (int)c.max_bytes, (int)c.mode);
+                return 1;
+            }
+        }
+
+        // Hangul vowels and trailing consonants compose with what's before them, and invalid
+        // bytes are codepoints by themselves.
+        if (truncate_utf8(u8"\u1100\u1161\u11A8", 8, truncate_mode::nfc_stable) != 0
+            || truncate_utf8(string("a\xE0\x80\x80" "b", 5), 2, truncate_mode::codepoint) != 2) {
+            printf("truncate_utf8 test failed\n");
+            return 1;
+        }
+    }
+
+    // Test display_width and truncate_width
+    {
+        using miniutf::display_width;
+        using miniutf::truncate_width;
+        const struct { string str; size_t expected; } cases[] = {
+            { u8"hello", 5 },
+            { u8"\u65E5\u672C\u8A9E", 6 },
+            { u8"\uFF21\uFF22 \uAC00", 7 },
+            { u8"e\u0301\u200D\u00AD", 2 },
+            { u8"\u1100\u1161\u11A8", 2 },
+            { u8"\u3247\u3248\u324F\u3250", 6 },
+            { string("tab\there\x7F\xFF", 10), 8 },
+            { u8"The quick brown fox\u0308 jumps over the lazy dog", 43 },
+            { u8"", 0 },
+        };
+        for (const auto & c : cases) {
+            if (display_width(c.str) != c.expected) {
+                printf("display_width(%s) test failed, got %d\n", c.str.c_str(),
+                       (int)display_width(c.str));
+                return 1;
+            }
+        }
+
+        // Every limit on a mix of widths, against the plain per-codepoint sum.
+        const string s = u8"ab\u65E5e\u0301\uFF21 0123456789abcdef\u0300\u8A9E!";
+        size_t expected_end = 0, expected_width = 0;
+        for (size_t max = 0; max < 30; max++) {
+            while (expected_end < s.size()) {
+                size_t next = expected_end;
+                const size_t w = miniutf::codepoint_width(miniutf::utf8_decode(s, next));
+                if (expected_width + w > max)
+                    break;
+                expected_end = next;
+                expected_width += w;
+            }
+            size_t width;
+            if (truncate_width(s, max, &width) != expected_end || width != expected_width) {
+                printf("truncate_width(%d) test failed\n", (int)max);
+                return 1;
+            }
+        }
+        if (expected_width != display_width(s) || truncate_width(s, 2) != 2
+            || truncate_width(u8"e\u0301\u0323x", 1) != 5) {
+            printf("truncate_width test failed\n");
+            return 1;
+        }
+    }
+
+    // Test codepoint counting and offset conversion
+    if (!check_offsets(u8"")) return 1;
+    if (!check_offsets(u8"The quick brown fox jumps over the lazy dog, 0123456789")) return 1;
+    if (!check_offsets(u8"Caf\u00E9 \u65E5\u672C\u8A9E \U0001F4A9\U0001F4A9 na\u0308ive, "
+                       u8"and then a long enough ASCII tail to take the fast path")) return 1;
+    if (!check_offsets(string("ab\xE0\x80\xC3\xA9\xF0\x9F\x92\xA9\x80\xFF" "cdefghijkl", 22)))
+        return 1;
+
+    // Test prefix_index
+    if (!check_prefix_index())
+        return 1;
+
+    // Test folded_name_index
+    if (!check_folded_name_index())
+        return 1;
+
+    // Test the offsets output of normalize32
+    {
+        std::vector<string::size_type> offsets;
+        std::u32string nfd = miniutf::normalize32(u8"a\u00E9\u1E0B\u0323", false, nullptr, &offsets);
+        std::vector<string::size_type> expected { 0, 1, 1, 3, 6, 3 };
+        if (nfd != U"ae\u0301d\u0323\u0307" || offsets != expected) {
+            printf("normalize32 offsets test failed\n");
+            return 1;
+        }
+    }
+
+    // Test normalize_batch
+    {
+        std::vector<string> inputs {
+            u8"", u8"plain ASCII name.txt", u8"e\u0301\u1E0B\u0323", u8"\uAC00\u11A8 \u00C5",
+            u8"a\u0301\u0323\u0302\u0316\u0307\u0317\u0308\u0318\u0309\u0319 (long run)",
+            string("bad \xFF byte"), u8"q\u0307\u0323", u8"o",
+        };
+        for (int i = 0; i < 40; i++)
+            inputs.back() += (i % 3) ? u8"\u0301" : u8"\u0323";
+        for (bool compose : { false, true }) {
+            for (unsigned threads : { 1, 2, 20 }) {
+                miniutf::normalized_batch out;
+                bool replaced = false;
+                miniutf::normalize_batch(inputs, compose, out, &replaced, threads);
+                bool ok = replaced && out.offsets.size() == inputs.size() + 1
+                          && out.offsets.back() == out.data.size();
+                for (size_t i = 0; ok && i < inputs.size(); i++) {
+                    ok = out.data.substr(out.offsets[i], out.offsets[i+1] - out.offsets[i])
+                         == miniutf::normalize8(inputs[i], compose);
+                }
+
+                // Runs of combining marks are sorted differently with the offsets output, and
+                // when they're long.
+                std::vector<string::size_type> offsets;
+                for (size_t i : { 4, 6, 7 }) {
+                    ok = ok && miniutf::normalize32(inputs[i], compose, nullptr, &offsets)
+                               == miniutf::normalize32(inputs[i], compose);
+                }
+                if (!ok) {
+                    printf("normalize_batch(%d, %u) test failed\n", (int)compose, threads);
+                    return 1;
+                }
+            }
+        }
+    }
+
+    if (!check_stats())
+        return 1;
+
+    if (!check_allocator_variants())
+        return 1;
+
+    if (!check_context())
+        return 1;
+
     // Hammer on match_key a bit
     {
         std::mt19937 gen; // note: unseeded - so this is deterministic